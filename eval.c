@@ -0,0 +1,330 @@
+#include "makemore.h"
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static void bigram_model_log_probs(void *state, const int *contexts,
+                                   int num_contexts, Scalar *out) {
+  Scalar *log_bigram = (Scalar *)state;
+  for (int i = 0; i < num_contexts; i++) {
+    memcpy(out + i * ALPHABET_SIZE, log_bigram + contexts[i] * ALPHABET_SIZE,
+           ALPHABET_SIZE * sizeof(Scalar));
+  }
+}
+
+LanguageModel *bigram_model_init(Scalar **bigram) {
+  Scalar *log_bigram =
+      (Scalar *)allocate(ALPHABET_SIZE * ALPHABET_SIZE * sizeof(Scalar));
+  for (int i = 0; i < ALPHABET_SIZE; i++) {
+    for (int j = 0; j < ALPHABET_SIZE; j++) {
+      log_bigram[i * ALPHABET_SIZE + j] = SCALAR_LOG(bigram[i][j]);
+    }
+  }
+
+  LanguageModel *model = (LanguageModel *)allocate(sizeof(LanguageModel));
+  model->block_size = 1;
+  model->state = log_bigram;
+  model->log_probs = bigram_model_log_probs;
+  model->free_state = free;
+  return model;
+}
+
+static void quantized_bigram_model_log_probs(void *state, const int *contexts,
+                                             int num_contexts, Scalar *out) {
+  int16_t *log_probs = (int16_t *)state;
+  for (int i = 0; i < num_contexts; i++) {
+    for (int j = 0; j < ALPHABET_SIZE; j++) {
+      out[i * ALPHABET_SIZE + j] =
+          (Scalar)log_probs[contexts[i] * ALPHABET_SIZE + j] /
+          QUANTIZED_LOG_PROB_SCALE;
+    }
+  }
+}
+
+LanguageModel *quantized_bigram_model_init(int16_t *log_probs) {
+  LanguageModel *model = (LanguageModel *)allocate(sizeof(LanguageModel));
+  model->block_size = 1;
+  model->state = log_probs;
+  model->log_probs = quantized_bigram_model_log_probs;
+  model->free_state = NULL;
+  return model;
+}
+
+// An MLP with either float or quantized weights, mapping one-hot contexts to
+// logits
+typedef struct MLPModel {
+  void *weights;
+  void (*forward)(void *weights, const int *contexts, int num_contexts,
+                  int block_size, Scalar *outputs);
+  int block_size;
+} MLPModel;
+
+static void mlp_model_log_probs(void *state, const int *contexts,
+                                int num_contexts, Scalar *out) {
+  MLPModel *mlp_model = (MLPModel *)state;
+  mlp_model->forward(mlp_model->weights, contexts, num_contexts,
+                     mlp_model->block_size, out);
+
+  for (int i = 0; i < num_contexts; i++) {
+    Scalar *logits = out + i * ALPHABET_SIZE;
+    kernels.log_softmax(logits, logits, ALPHABET_SIZE);
+  }
+}
+
+static LanguageModel *mlp_model_init_with_forward(
+    void *weights,
+    void (*forward)(void *, const int *, int, int, Scalar *),
+    int block_size) {
+  MLPModel *mlp_model = (MLPModel *)allocate(sizeof(MLPModel));
+  mlp_model->weights = weights;
+  mlp_model->forward = forward;
+  mlp_model->block_size = block_size;
+
+  LanguageModel *model = (LanguageModel *)allocate(sizeof(LanguageModel));
+  model->block_size = block_size;
+  model->state = mlp_model;
+  model->log_probs = mlp_model_log_probs;
+  model->free_state = free;
+  return model;
+}
+
+static void mlp_weights_forward_any(void *weights, const int *contexts,
+                                    int num_contexts, int block_size,
+                                    Scalar *outputs) {
+  mlp_weights_forward_contexts((MLPWeights *)weights, contexts, num_contexts,
+                               block_size, outputs);
+}
+
+static void quantized_mlp_forward_any(void *mlp, const int *contexts,
+                                      int num_contexts, int block_size,
+                                      Scalar *outputs) {
+  quantized_mlp_forward_contexts((QuantizedMLP *)mlp, contexts, num_contexts,
+                                 block_size, outputs);
+}
+
+LanguageModel *mlp_model_init(MLPWeights *weights, int block_size) {
+  return mlp_model_init_with_forward(weights, mlp_weights_forward_any,
+                                     block_size);
+}
+
+LanguageModel *quantized_mlp_model_init(QuantizedMLP *mlp, int block_size) {
+  return mlp_model_init_with_forward(mlp, quantized_mlp_forward_any,
+                                     block_size);
+}
+
+void language_model_free(LanguageModel *model) {
+  if (model->free_state != NULL) {
+    model->free_state(model->state);
+  }
+  free(model);
+}
+
+enum Split split_next_word(Rng *rng) {
+  Scalar r = rng_uniform(rng);
+  if (r < 0.8) {
+    return TRAIN;
+  }
+  if (r < 0.9) {
+    return DEV;
+  }
+  return TEST;
+}
+
+Dataset *dataset_load(const char *path, enum Split split, uint64_t seed) {
+  FILE *stream = fopen(path, "r");
+  if (stream == NULL) {
+    exit(1);
+  }
+
+  Dataset *dataset = (Dataset *)allocate(sizeof(Dataset));
+  int capacity = 1024;
+  dataset->num_words = 0;
+  dataset->words = (char **)allocate(capacity * sizeof(char *));
+
+  Rng rng;
+  rng_seed(&rng, seed);
+
+  size_t len = 0;
+  char *line = NULL;
+  while (getline(&line, &len, stream) != -1) {
+    if (split_next_word(&rng) != split) {
+      continue;
+    }
+
+    // Stop at the newline or any other character outside the alphabet
+    int num_chars = 0;
+    while (line[num_chars] >= 'a' && line[num_chars] <= 'z') {
+      num_chars++;
+    }
+    if (num_chars == 0) {
+      continue;
+    }
+
+    if (dataset->num_words == capacity) {
+      capacity *= 2;
+      dataset->words =
+          (char **)realloc(dataset->words, capacity * sizeof(char *));
+      if (dataset->words == NULL) {
+        exit(1);
+      }
+    }
+    char *word = (char *)allocate(num_chars + 1);
+    memcpy(word, line, num_chars);
+    word[num_chars] = '\0';
+    dataset->words[dataset->num_words++] = word;
+  }
+
+  free(line);
+  fclose(stream);
+  return dataset;
+}
+
+void dataset_free(Dataset *dataset) {
+  for (int i = 0; i < dataset->num_words; i++) {
+    free(dataset->words[i]);
+  }
+  free(dataset->words);
+  free(dataset);
+}
+
+// Number of contexts passed to the model per log_probs call
+#define EVAL_BATCH_SIZE 256
+
+// Kahan-compensated running sum
+typedef struct KahanSum {
+  double sum;
+  double compensation;
+} KahanSum;
+
+static void kahan_add(KahanSum *kahan, double value) {
+  double y = value - kahan->compensation;
+  double t = kahan->sum + y;
+  kahan->compensation = (t - kahan->sum) - y;
+  kahan->sum = t;
+}
+
+typedef struct EvalTask {
+  LanguageModel *model;
+  char **words;
+  int num_words;
+  KahanSum nll;
+  long num_tokens;
+} EvalTask;
+
+static void eval_flush(LanguageModel *model, const int *contexts,
+                       const int *targets, int num_contexts, Scalar *log_probs,
+                       KahanSum *nll) {
+  model->log_probs(model->state, contexts, num_contexts, log_probs);
+  for (int i = 0; i < num_contexts; i++) {
+    kahan_add(nll, -log_probs[i * ALPHABET_SIZE + targets[i]]);
+  }
+}
+
+static void *eval_task(void *arg) {
+  EvalTask *task = (EvalTask *)arg;
+  int block_size = task->model->block_size;
+
+  int *contexts = (int *)allocate(EVAL_BATCH_SIZE * block_size * sizeof(int));
+  int *targets = (int *)allocate(EVAL_BATCH_SIZE * sizeof(int));
+  Scalar *log_probs =
+      (Scalar *)allocate(EVAL_BATCH_SIZE * ALPHABET_SIZE * sizeof(Scalar));
+  int *context = (int *)allocate(block_size * sizeof(int));
+  int num_contexts = 0;
+
+  // Tasks sit next to each other in one array, so accumulate locally rather
+  // than sharing cache lines with the other threads
+  KahanSum nll = {0, 0};
+  long num_tokens = 0;
+
+  for (int i = 0; i < task->num_words; i++) {
+    char *word = task->words[i];
+    memset(context, 0, block_size * sizeof(int));
+
+    // Every character plus the end token is predicted once
+    for (int j = 0;; j++) {
+      int target = word[j] == '\0' ? 0 : CHAR_TO_INDEX(word[j]);
+
+      memcpy(contexts + num_contexts * block_size, context,
+             block_size * sizeof(int));
+      targets[num_contexts++] = target;
+      if (num_contexts == EVAL_BATCH_SIZE) {
+        eval_flush(task->model, contexts, targets, num_contexts, log_probs,
+                   &nll);
+        num_tokens += num_contexts;
+        num_contexts = 0;
+      }
+
+      if (target == 0) {
+        break;
+      }
+      memmove(context, context + 1, (block_size - 1) * sizeof(int));
+      context[block_size - 1] = target;
+    }
+  }
+  if (num_contexts > 0) {
+    eval_flush(task->model, contexts, targets, num_contexts, log_probs, &nll);
+    num_tokens += num_contexts;
+  }
+  task->nll = nll;
+  task->num_tokens = num_tokens;
+
+  free(context);
+  free(log_probs);
+  free(targets);
+  free(contexts);
+  return NULL;
+}
+
+// Mean per-token NLL of the model over the dataset. Each thread scores a
+// contiguous range of words and the partial sums are reduced in thread order,
+// so the result doesn't depend on scheduling.
+Evaluation evaluate(LanguageModel *model, Dataset *dataset, int num_threads) {
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  if (num_threads < 1) {
+    num_threads = 1;
+  }
+  EvalTask *tasks = (EvalTask *)allocate(num_threads * sizeof(EvalTask));
+  pthread_t *threads = (pthread_t *)allocate(num_threads * sizeof(pthread_t));
+
+  int first_word = 0;
+  for (int t = 0; t < num_threads; t++) {
+    int count = dataset->num_words / num_threads +
+                (t < dataset->num_words % num_threads);
+    tasks[t].model = model;
+    tasks[t].words = dataset->words + first_word;
+    tasks[t].num_words = count;
+    first_word += count;
+
+    if (pthread_create(&threads[t], NULL, eval_task, &tasks[t]) != 0) {
+      exit(1);
+    }
+  }
+
+  KahanSum nll = {0, 0};
+  long num_tokens = 0;
+  for (int t = 0; t < num_threads; t++) {
+    pthread_join(threads[t], NULL);
+    kahan_add(&nll, tasks[t].nll.sum);
+    kahan_add(&nll, -tasks[t].nll.compensation);
+    num_tokens += tasks[t].num_tokens;
+  }
+
+  free(threads);
+  free(tasks);
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  Evaluation evaluation;
+  evaluation.nll = num_tokens > 0 ? nll.sum / num_tokens : 0;
+  evaluation.num_tokens = num_tokens;
+  evaluation.seconds =
+      (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  evaluation.tokens_per_second =
+      evaluation.seconds > 0 ? num_tokens / evaluation.seconds : 0;
+  return evaluation;
+}
@@ -0,0 +1,373 @@
+#include "makemore.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Stop once this many sequences per requested word have finished, in case the
+// model can't produce enough unique words
+#define GENERATE_MAX_ATTEMPTS_PER_WORD 100
+
+// Open-addressing hash set of generated words
+typedef struct WordSet {
+  char **slots;
+  int capacity;
+  int size;
+} WordSet;
+
+static uint64_t word_hash(const char *word) {
+  // FNV-1a
+  uint64_t hash = 0xcbf29ce484222325;
+  for (; *word != '\0'; word++) {
+    hash ^= (unsigned char)*word;
+    hash *= 0x100000001b3;
+  }
+  return hash;
+}
+
+static void word_set_init(WordSet *set, int capacity) {
+  set->capacity = capacity;
+  set->size = 0;
+  set->slots = (char **)allocate(capacity * sizeof(char *));
+  memset(set->slots, 0, capacity * sizeof(char *));
+}
+
+static void word_set_free(WordSet *set) {
+  for (int i = 0; i < set->capacity; i++) {
+    free(set->slots[i]);
+  }
+  free(set->slots);
+}
+
+// Takes ownership of word
+static void word_set_put(WordSet *set, char *word) {
+  int mask = set->capacity - 1;
+  int i = word_hash(word) & mask;
+  while (set->slots[i] != NULL) {
+    i = (i + 1) & mask;
+  }
+  set->slots[i] = word;
+  set->size++;
+}
+
+// Adds a copy of word, returning 0 if it was already present
+static int word_set_add(WordSet *set, const char *word, int num_chars) {
+  int mask = set->capacity - 1;
+  for (int i = word_hash(word) & mask; set->slots[i] != NULL;
+       i = (i + 1) & mask) {
+    if (strcmp(set->slots[i], word) == 0) {
+      return 0;
+    }
+  }
+
+  // Keep the load factor at most 1/2
+  if (2 * (set->size + 1) > set->capacity) {
+    WordSet grown;
+    word_set_init(&grown, 2 * set->capacity);
+    for (int i = 0; i < set->capacity; i++) {
+      if (set->slots[i] != NULL) {
+        word_set_put(&grown, set->slots[i]);
+      }
+    }
+    free(set->slots);
+    *set = grown;
+  }
+
+  char *copy = (char *)allocate(num_chars + 1);
+  memcpy(copy, word, num_chars + 1);
+  word_set_put(set, copy);
+  return 1;
+}
+
+typedef struct Candidate {
+  Scalar score;
+  int index;
+} Candidate;
+
+static int candidate_compare(const void *a, const void *b) {
+  Scalar score_a = ((const Candidate *)a)->score;
+  Scalar score_b = ((const Candidate *)b)->score;
+  if (score_a != score_b) {
+    return score_a > score_b ? -1 : 1;
+  }
+  // Break ties by index so the order doesn't depend on qsort
+  return ((const Candidate *)a)->index - ((const Candidate *)b)->index;
+}
+
+// Samples the next token from one row of log-probs after temperature scaling
+// and top-k / top-p filtering
+static int sample_filtered(const Scalar *log_probs, GenerateConfig *config,
+                           Rng *rng) {
+  // Without filtering the tokens don't need to be ranked
+  if (config->temperature > 0 && config->top_k <= 0 && config->top_p >= 1) {
+    Scalar probs[ALPHABET_SIZE];
+    for (int i = 0; i < ALPHABET_SIZE; i++) {
+      probs[i] = log_probs[i] / config->temperature;
+    }
+    kernels.softmax(probs, probs, ALPHABET_SIZE);
+
+    Scalar random_num = rng_uniform(rng);
+    Scalar cumulative = 0;
+    for (int i = 0; i < ALPHABET_SIZE; i++) {
+      cumulative += probs[i];
+      if (random_num < cumulative) {
+        return i;
+      }
+    }
+    return ALPHABET_SIZE - 1;
+  }
+
+  Candidate candidates[ALPHABET_SIZE];
+  for (int i = 0; i < ALPHABET_SIZE; i++) {
+    candidates[i].score = log_probs[i];
+    candidates[i].index = i;
+  }
+  qsort(candidates, ALPHABET_SIZE, sizeof(Candidate), candidate_compare);
+
+  if (config->temperature <= 0) {
+    return candidates[0].index;
+  }
+
+  int num_kept = ALPHABET_SIZE;
+  if (config->top_k > 0 && config->top_k < num_kept) {
+    num_kept = config->top_k;
+  }
+
+  Scalar probs[ALPHABET_SIZE];
+  for (int i = 0; i < num_kept; i++) {
+    probs[i] = candidates[i].score / config->temperature;
+  }
+  kernels.softmax(probs, probs, num_kept);
+  Scalar total = 1;
+
+  // Keep the smallest prefix whose probability reaches top_p
+  if (config->top_p < 1) {
+    Scalar cumulative = 0;
+    for (int i = 0; i < num_kept; i++) {
+      cumulative += probs[i];
+      if (cumulative >= config->top_p * total) {
+        num_kept = i + 1;
+        total = cumulative;
+        break;
+      }
+    }
+  }
+
+  Scalar random_num = rng_uniform(rng) * total;
+  Scalar cumulative = 0;
+  for (int i = 0; i < num_kept; i++) {
+    cumulative += probs[i];
+    if (random_num < cumulative) {
+      return candidates[i].index;
+    }
+  }
+  return candidates[num_kept - 1].index;
+}
+
+// A partially generated word and the context that predicts its next token
+typedef struct Sequence {
+  int *context;
+  char *chars;
+  int num_chars;
+  Scalar score;
+} Sequence;
+
+static void sequence_reset(Sequence *sequence, int block_size) {
+  memset(sequence->context, 0, block_size * sizeof(int));
+  sequence->num_chars = 0;
+  sequence->score = 0;
+}
+
+static void sequence_copy(Sequence *to, Sequence *from, int block_size) {
+  memcpy(to->context, from->context, block_size * sizeof(int));
+  memcpy(to->chars, from->chars, from->num_chars);
+  to->num_chars = from->num_chars;
+  to->score = from->score;
+}
+
+static void sequence_append(Sequence *sequence, int token, int block_size) {
+  memmove(sequence->context, sequence->context + 1,
+          (block_size - 1) * sizeof(int));
+  sequence->context[block_size - 1] = token;
+  sequence->chars[sequence->num_chars++] = INDEX_TO_CHAR(token);
+}
+
+static Sequence *sequences_init(int num_sequences, int block_size,
+                                int max_chars) {
+  Sequence *sequences =
+      (Sequence *)allocate(num_sequences * sizeof(Sequence));
+  for (int i = 0; i < num_sequences; i++) {
+    sequences[i].context = (int *)allocate(block_size * sizeof(int));
+    sequences[i].chars = (char *)allocate(max_chars + 1);
+    sequence_reset(&sequences[i], block_size);
+  }
+  return sequences;
+}
+
+static void sequences_free(Sequence *sequences, int num_sequences) {
+  for (int i = 0; i < num_sequences; i++) {
+    free(sequences[i].context);
+    free(sequences[i].chars);
+  }
+  free(sequences);
+}
+
+// Emits the sequence if it's a new word. Returns 1 if it was emitted.
+static int emit(Sequence *sequence, WordSet *seen, GenerateCallback callback,
+                void *data) {
+  if (sequence->num_chars == 0) {
+    return 0;
+  }
+  sequence->chars[sequence->num_chars] = '\0';
+  if (!word_set_add(seen, sequence->chars, sequence->num_chars)) {
+    return 0;
+  }
+  callback(sequence->chars, data);
+  return 1;
+}
+
+static int generate_sampled(LanguageModel *model, GenerateConfig *config,
+                            Rng *rng, int num_words, WordSet *seen,
+                            GenerateCallback callback, void *data) {
+  int block_size = model->block_size;
+  int batch_size = config->batch_size;
+  Sequence *sequences =
+      sequences_init(batch_size, block_size, config->max_chars);
+  int *contexts = (int *)allocate(batch_size * block_size * sizeof(int));
+  Scalar *log_probs =
+      (Scalar *)allocate(batch_size * ALPHABET_SIZE * sizeof(Scalar));
+
+  // Only as many sequences as there are words left to generate are in flight.
+  // Stopping at the first num_words to finish would favour short words.
+  long max_attempts = (long)num_words * GENERATE_MAX_ATTEMPTS_PER_WORD;
+  long attempts = 0;
+  int num_emitted = 0;
+  int num_active = 0;
+  while (1) {
+    while (num_active < batch_size && num_emitted + num_active < num_words &&
+           attempts + num_active < max_attempts) {
+      sequence_reset(&sequences[num_active++], block_size);
+    }
+    if (num_active == 0) {
+      break;
+    }
+
+    for (int i = 0; i < num_active; i++) {
+      memcpy(contexts + i * block_size, sequences[i].context,
+             block_size * sizeof(int));
+    }
+    model->log_probs(model->state, contexts, num_active, log_probs);
+
+    // Advance every sequence, moving the unfinished ones to the front
+    int num_unfinished = 0;
+    for (int i = 0; i < num_active; i++) {
+      Sequence *sequence = &sequences[i];
+      int token =
+          sample_filtered(log_probs + i * ALPHABET_SIZE, config, rng);
+
+      if (token == 0) {
+        num_emitted += emit(sequence, seen, callback, data);
+        attempts++;
+      } else if (sequence->num_chars == config->max_chars) {
+        // Too long, drop it
+        attempts++;
+      } else {
+        sequence_append(sequence, token, block_size);
+        Sequence swap = sequences[num_unfinished];
+        sequences[num_unfinished++] = *sequence;
+        *sequence = swap;
+      }
+    }
+    num_active = num_unfinished;
+  }
+
+  free(log_probs);
+  free(contexts);
+  sequences_free(sequences, batch_size);
+  return num_emitted;
+}
+
+// Beam search that keeps beam_width unfinished sequences. Sequences that end
+// are emitted in order of score and leave the beam, so successive steps
+// produce the next most likely words.
+static int generate_beam(LanguageModel *model, GenerateConfig *config,
+                         int num_words, WordSet *seen,
+                         GenerateCallback callback, void *data) {
+  int block_size = model->block_size;
+  int beam_width = config->beam_width;
+  int num_candidates = beam_width * ALPHABET_SIZE;
+
+  Sequence *beams = sequences_init(beam_width, block_size, config->max_chars);
+  Sequence *next_beams =
+      sequences_init(beam_width, block_size, config->max_chars);
+  int *contexts = (int *)allocate(beam_width * block_size * sizeof(int));
+  Scalar *log_probs =
+      (Scalar *)allocate(num_candidates * sizeof(Scalar));
+  Candidate *candidates =
+      (Candidate *)allocate(num_candidates * sizeof(Candidate));
+
+  int num_beams = 1;
+  int num_emitted = 0;
+  for (int step = 0; step <= config->max_chars && num_beams > 0 &&
+                     num_emitted < num_words;
+       step++) {
+    for (int i = 0; i < num_beams; i++) {
+      memcpy(contexts + i * block_size, beams[i].context,
+             block_size * sizeof(int));
+    }
+    model->log_probs(model->state, contexts, num_beams, log_probs);
+
+    for (int i = 0; i < num_beams * ALPHABET_SIZE; i++) {
+      candidates[i].score = beams[i / ALPHABET_SIZE].score + log_probs[i];
+      candidates[i].index = i;
+    }
+    qsort(candidates, num_beams * ALPHABET_SIZE, sizeof(Candidate),
+          candidate_compare);
+
+    int num_next_beams = 0;
+    for (int i = 0; i < num_beams * ALPHABET_SIZE &&
+                    num_next_beams < beam_width && num_emitted < num_words;
+         i++) {
+      Sequence *beam = &beams[candidates[i].index / ALPHABET_SIZE];
+      int token = candidates[i].index % ALPHABET_SIZE;
+
+      if (token == 0) {
+        num_emitted += emit(beam, seen, callback, data);
+      } else if (beam->num_chars < config->max_chars) {
+        Sequence *next_beam = &next_beams[num_next_beams++];
+        sequence_copy(next_beam, beam, block_size);
+        sequence_append(next_beam, token, block_size);
+        next_beam->score = candidates[i].score;
+      }
+    }
+
+    Sequence *swap = beams;
+    beams = next_beams;
+    next_beams = swap;
+    num_beams = num_next_beams;
+  }
+
+  free(candidates);
+  free(log_probs);
+  free(contexts);
+  sequences_free(next_beams, beam_width);
+  sequences_free(beams, beam_width);
+  return num_emitted;
+}
+
+int generate(LanguageModel *model, GenerateConfig *config, Rng *rng,
+             int num_words, GenerateCallback callback, void *data) {
+  WordSet seen;
+  word_set_init(&seen, 64);
+
+  int num_emitted;
+  if (config->beam_width > 0) {
+    num_emitted =
+        generate_beam(model, config, num_words, &seen, callback, data);
+  } else {
+    num_emitted = generate_sampled(model, config, rng, num_words, &seen,
+                                   callback, data);
+  }
+
+  word_set_free(&seen);
+  return num_emitted;
+}
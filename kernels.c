@@ -0,0 +1,112 @@
+#include "makemore.h"
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) &&                             \
+    (defined(__GNUC__) || defined(__clang__))
+#define KERNELS_X86
+#endif
+
+#ifdef KERNELS_X86
+
+// Integer types with the same width as Scalar, used for bit manipulation in
+// the vectorized exp and log. SCALAR_ROUND_SHIFTER is 1.5 * 2^mantissa_bits.
+#ifdef MAKEMORE_FLOAT32
+typedef int32_t ScalarBits;
+typedef uint32_t UScalarBits;
+#define SCALAR_MANTISSA_BITS 23
+#define SCALAR_EXPONENT_BIAS 127
+#define SCALAR_EXP_MIN -87.0f
+#define SCALAR_EXP_MAX 88.0f
+#define SCALAR_ROUND_SHIFTER 12582912.0f
+#else
+typedef int64_t ScalarBits;
+typedef uint64_t UScalarBits;
+#define SCALAR_MANTISSA_BITS 52
+#define SCALAR_EXPONENT_BIAS 1023
+#define SCALAR_EXP_MIN -708.0
+#define SCALAR_EXP_MAX 709.0
+#define SCALAR_ROUND_SHIFTER 6755399441055744.0
+#endif
+
+// Taylor coefficients 1/k! of exp(r) for |r| <= ln(2)/2
+static const Scalar exp_coefficients[] = {
+    1.0,
+    1.0,
+    1.0 / 2,
+    1.0 / 6,
+    1.0 / 24,
+    1.0 / 120,
+    1.0 / 720,
+    1.0 / 5040,
+    1.0 / 40320,
+    1.0 / 362880,
+    1.0 / 3628800,
+    1.0 / 39916800,
+    1.0 / 479001600,
+};
+
+// Coefficients 1/(2k+1) of the series log(m) = 2s * sum(s^2k / (2k+1)) with
+// s = (m-1)/(m+1), |s| <= 0.172 for m in [sqrt(1/2), sqrt(2))
+static const Scalar log_coefficients[] = {
+    1.0,      1.0 / 3,  1.0 / 5,  1.0 / 7,  1.0 / 9,  1.0 / 11,
+    1.0 / 13, 1.0 / 15, 1.0 / 17, 1.0 / 19, 1.0 / 21,
+};
+
+// Enough terms to reach the precision of Scalar
+#ifdef MAKEMORE_FLOAT32
+#define EXP_DEGREE 7
+#define LOG_DEGREE 4
+#else
+#define EXP_DEGREE 12
+#define LOG_DEGREE 10
+#endif
+
+#define KERNEL_ISA sse2
+#define KERNEL_TARGET "sse2"
+#define KERNEL_BYTES 16
+#include "kernels_impl.h"
+
+#define KERNEL_ISA avx2
+#define KERNEL_TARGET "avx2,fma"
+#define KERNEL_BYTES 32
+#include "kernels_impl.h"
+
+#define KERNEL_ISA avx512
+#define KERNEL_TARGET "avx512f,avx512bw"
+#define KERNEL_BYTES 64
+#include "kernels_impl.h"
+
+#endif
+
+int kernels_available(const Kernels **variants) {
+  int num_variants = 0;
+  variants[num_variants++] = &kernels_scalar;
+
+#ifdef KERNELS_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2")) {
+    variants[num_variants++] = &kernels_sse2;
+  }
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    variants[num_variants++] = &kernels_avx2;
+  }
+  if (__builtin_cpu_supports("avx512f") &&
+      __builtin_cpu_supports("avx512bw")) {
+    variants[num_variants++] = &kernels_avx512;
+  }
+#endif
+
+  return num_variants;
+}
+
+void kernels_init() {
+  const Kernels *variants[KERNELS_MAX_VARIANTS];
+  int num_variants = kernels_available(variants);
+
+  // Variants are listed from slowest to fastest. This holds for every kernel
+  // in both float32 and float64 builds only because exp and log avoid
+  // float <-> int64 conversions; recheck the ordering when adding a kernel.
+  kernels = *variants[num_variants - 1];
+}
@@ -0,0 +1,329 @@
+// Vectorized kernels, instantiated once per instruction set by kernels.c with
+// KERNEL_ISA, KERNEL_TARGET and KERNEL_BYTES defined. The vector width follows
+// from KERNEL_BYTES and the size of Scalar, so the same source covers float32
+// and float64 builds.
+
+#define KERNEL_CONCAT_(a, b) a##_##b
+#define KERNEL_CONCAT(a, b) KERNEL_CONCAT_(a, b)
+#define KERNEL_FN(name) KERNEL_CONCAT(name, KERNEL_ISA)
+#define KERNEL_STRING_(a) #a
+#define KERNEL_STRING(a) KERNEL_STRING_(a)
+#define KERNEL_ATTR __attribute__((target(KERNEL_TARGET)))
+
+#define VEC KERNEL_FN(vec)
+#define IVEC KERNEL_FN(ivec)
+#define UVEC KERNEL_FN(uvec)
+#define LANES (KERNEL_BYTES / (int)sizeof(Scalar))
+
+typedef Scalar VEC __attribute__((vector_size(KERNEL_BYTES)));
+typedef ScalarBits IVEC __attribute__((vector_size(KERNEL_BYTES)));
+typedef UScalarBits UVEC __attribute__((vector_size(KERNEL_BYTES)));
+
+static inline KERNEL_ATTR VEC KERNEL_FN(splat)(Scalar value) {
+  return (VEC){0} + value;
+}
+
+static inline KERNEL_ATTR VEC KERNEL_FN(load)(const Scalar *values) {
+  VEC v;
+  memcpy(&v, values, sizeof(v));
+  return v;
+}
+
+static inline KERNEL_ATTR void KERNEL_FN(store)(Scalar *values, VEC v) {
+  memcpy(values, &v, sizeof(v));
+}
+
+// Loads the last n < LANES values, padding the remaining lanes with fill
+static inline KERNEL_ATTR VEC KERNEL_FN(load_partial)(const Scalar *values,
+                                                      int n, Scalar fill) {
+  Scalar padded[LANES];
+  for (int i = 0; i < LANES; i++) {
+    padded[i] = i < n ? values[i] : fill;
+  }
+  return KERNEL_FN(load)(padded);
+}
+
+static inline KERNEL_ATTR void KERNEL_FN(store_partial)(Scalar *values, int n,
+                                                        VEC v) {
+  Scalar padded[LANES];
+  KERNEL_FN(store)(padded, v);
+  memcpy(values, padded, n * sizeof(Scalar));
+}
+
+// Lane-wise mask ? a : b, where mask lanes are all ones or all zeros
+static inline KERNEL_ATTR VEC KERNEL_FN(select)(IVEC mask, VEC a, VEC b) {
+  return (VEC)(((IVEC)a & mask) | ((IVEC)b & ~mask));
+}
+
+static inline KERNEL_ATTR Scalar KERNEL_FN(sum)(VEC v) {
+  Scalar sum = 0;
+  for (int i = 0; i < LANES; i++) {
+    sum += v[i];
+  }
+  return sum;
+}
+
+static inline KERNEL_ATTR Scalar KERNEL_FN(max)(VEC v) {
+  Scalar max = v[0];
+  for (int i = 1; i < LANES; i++) {
+    if (v[i] > max) {
+      max = v[i];
+    }
+  }
+  return max;
+}
+
+// exp(x) = 2^k * exp(r) with k = round(x / ln(2)) and |r| <= ln(2)/2. Inputs
+// below SCALAR_EXP_MIN return exp(SCALAR_EXP_MIN) rather than a denormal.
+static inline KERNEL_ATTR VEC KERNEL_FN(exp)(VEC x) {
+  VEC lo = KERNEL_FN(splat)(SCALAR_EXP_MIN);
+  VEC hi = KERNEL_FN(splat)(SCALAR_EXP_MAX);
+  x = KERNEL_FN(select)(x < lo, lo, x);
+  x = KERNEL_FN(select)(x > hi, hi, x);
+
+  // Adding SCALAR_ROUND_SHIFTER rounds t to an integer k held in the low
+  // mantissa bits, which avoids float <-> int64 conversions that SSE2 and AVX2
+  // lack for doubles
+  VEC shifted = x * (Scalar)1.4426950408889634 + SCALAR_ROUND_SHIFTER;
+  IVEC k = (IVEC)shifted - (IVEC)KERNEL_FN(splat)(SCALAR_ROUND_SHIFTER);
+  VEC kf = shifted - SCALAR_ROUND_SHIFTER;
+
+  // Subtract k * ln(2) in two parts to keep r exact
+  VEC r = x - kf * (Scalar)0.693145751953125;
+  r = r - kf * (Scalar)1.428606820309417232e-6;
+
+  VEC p = KERNEL_FN(splat)(exp_coefficients[EXP_DEGREE]);
+  for (int i = EXP_DEGREE - 1; i >= 0; i--) {
+    p = p * r + exp_coefficients[i];
+  }
+
+  IVEC scale = (k + SCALAR_EXPONENT_BIAS) << SCALAR_MANTISSA_BITS;
+  return p * (VEC)scale;
+}
+
+// log(x) = e * ln(2) + log(m) with x = m * 2^e and m in [sqrt(1/2), sqrt(2)).
+// Only defined for positive, normal x.
+static inline KERNEL_ATTR VEC KERNEL_FN(log)(VEC x) {
+  const ScalarBits mantissa_mask = ((ScalarBits)1 << SCALAR_MANTISSA_BITS) - 1;
+
+  // x is positive, so a logical shift extracts the exponent. Arithmetic 64-bit
+  // shifts need AVX-512.
+  IVEC bits = (IVEC)x;
+  IVEC e = (IVEC)((UVEC)bits >> SCALAR_MANTISSA_BITS) - SCALAR_EXPONENT_BIAS;
+  VEC m = (VEC)((bits & mantissa_mask) |
+                ((ScalarBits)SCALAR_EXPONENT_BIAS << SCALAR_MANTISSA_BITS));
+
+  IVEC large = m > (Scalar)1.4142135623730951;
+  m = KERNEL_FN(select)(large, m * (Scalar)0.5, m);
+  e = e - large;
+
+  VEC s = (m - 1) / (m + 1);
+  VEC z = s * s;
+  VEC p = KERNEL_FN(splat)(log_coefficients[LOG_DEGREE]);
+  for (int i = LOG_DEGREE - 1; i >= 0; i--) {
+    p = p * z + log_coefficients[i];
+  }
+
+  VEC shifter = KERNEL_FN(splat)(SCALAR_ROUND_SHIFTER);
+  VEC ef = (VEC)(e + (IVEC)shifter) - shifter;
+  return ef * (Scalar)0.6931471805599453 + 2 * s * p;
+}
+
+static inline KERNEL_ATTR VEC KERNEL_FN(tanh_vec)(VEC x) {
+  return 1 - 2 / (KERNEL_FN(exp)(2 * x) + 1);
+}
+
+static KERNEL_ATTR Scalar KERNEL_FN(dot)(const Scalar *a, const Scalar *b,
+                                         int n) {
+  VEC sum = {0};
+  int i = 0;
+  for (; i + LANES <= n; i += LANES) {
+    sum += KERNEL_FN(load)(a + i) * KERNEL_FN(load)(b + i);
+  }
+  if (i < n) {
+    sum += KERNEL_FN(load_partial)(a + i, n - i, 0) *
+           KERNEL_FN(load_partial)(b + i, n - i, 0);
+  }
+  return KERNEL_FN(sum)(sum);
+}
+
+static KERNEL_ATTR void KERNEL_FN(tanh)(Scalar *out, const Scalar *in, int n) {
+  int i = 0;
+  for (; i + LANES <= n; i += LANES) {
+    KERNEL_FN(store)(out + i, KERNEL_FN(tanh_vec)(KERNEL_FN(load)(in + i)));
+  }
+  if (i < n) {
+    VEC x = KERNEL_FN(load_partial)(in + i, n - i, 0);
+    KERNEL_FN(store_partial)(out + i, n - i, KERNEL_FN(tanh_vec)(x));
+  }
+}
+
+static inline KERNEL_ATTR VEC KERNEL_FN(tanh_fast_vec)(VEC x) {
+  VEC lo = KERNEL_FN(splat)(-TANH_FAST_CLAMP);
+  VEC hi = KERNEL_FN(splat)(TANH_FAST_CLAMP);
+  x = KERNEL_FN(select)(x < lo, lo, x);
+  x = KERNEL_FN(select)(x > hi, hi, x);
+
+  VEC x2 = x * x;
+  return x * (135135 + x2 * (17325 + x2 * (378 + x2))) /
+         (135135 + x2 * (62370 + x2 * (3150 + x2 * 28)));
+}
+
+static KERNEL_ATTR void KERNEL_FN(tanh_fast)(Scalar *out, const Scalar *in,
+                                             int n) {
+  int i = 0;
+  for (; i + LANES <= n; i += LANES) {
+    VEC x = KERNEL_FN(load)(in + i);
+    KERNEL_FN(store)(out + i, KERNEL_FN(tanh_fast_vec)(x));
+  }
+  if (i < n) {
+    VEC x = KERNEL_FN(load_partial)(in + i, n - i, 0);
+    KERNEL_FN(store_partial)(out + i, n - i, KERNEL_FN(tanh_fast_vec)(x));
+  }
+}
+
+static KERNEL_ATTR void KERNEL_FN(softmax)(Scalar *out, const Scalar *in,
+                                           int n) {
+  VEC max = KERNEL_FN(load_partial)(in, n < LANES ? n : LANES, in[0]);
+  int i = 0;
+  for (; i + LANES <= n; i += LANES) {
+    VEC x = KERNEL_FN(load)(in + i);
+    max = KERNEL_FN(select)(x > max, x, max);
+  }
+  if (i < n) {
+    VEC x = KERNEL_FN(load_partial)(in + i, n - i, in[0]);
+    max = KERNEL_FN(select)(x > max, x, max);
+  }
+  Scalar max_value = KERNEL_FN(max)(max);
+
+  VEC sum = {0};
+  for (i = 0; i + LANES <= n; i += LANES) {
+    VEC e = KERNEL_FN(exp)(KERNEL_FN(load)(in + i) - max_value);
+    KERNEL_FN(store)(out + i, e);
+    sum += e;
+  }
+  Scalar total = KERNEL_FN(sum)(sum);
+  for (; i < n; i++) {
+    out[i] = SCALAR_EXP(in[i] - max_value);
+    total += out[i];
+  }
+
+  Scalar inverse = 1 / total;
+  for (i = 0; i + LANES <= n; i += LANES) {
+    KERNEL_FN(store)(out + i, KERNEL_FN(load)(out + i) * inverse);
+  }
+  for (; i < n; i++) {
+    out[i] *= inverse;
+  }
+}
+
+static KERNEL_ATTR void KERNEL_FN(log_softmax)(Scalar *out, const Scalar *in,
+                                               int n) {
+  VEC max = KERNEL_FN(load_partial)(in, n < LANES ? n : LANES, in[0]);
+  int i = 0;
+  for (; i + LANES <= n; i += LANES) {
+    VEC x = KERNEL_FN(load)(in + i);
+    max = KERNEL_FN(select)(x > max, x, max);
+  }
+  if (i < n) {
+    VEC x = KERNEL_FN(load_partial)(in + i, n - i, in[0]);
+    max = KERNEL_FN(select)(x > max, x, max);
+  }
+  Scalar max_value = KERNEL_FN(max)(max);
+
+  VEC sum = {0};
+  for (i = 0; i + LANES <= n; i += LANES) {
+    sum += KERNEL_FN(exp)(KERNEL_FN(load)(in + i) - max_value);
+  }
+  Scalar total = KERNEL_FN(sum)(sum);
+  for (; i < n; i++) {
+    total += SCALAR_EXP(in[i] - max_value);
+  }
+
+  Scalar log_sum = max_value + SCALAR_LOG(total);
+  for (i = 0; i + LANES <= n; i += LANES) {
+    KERNEL_FN(store)(out + i, KERNEL_FN(load)(in + i) - log_sum);
+  }
+  for (; i < n; i++) {
+    out[i] = in[i] - log_sum;
+  }
+}
+
+static KERNEL_ATTR Scalar KERNEL_FN(nll_sum)(const Scalar *probs, int n) {
+  VEC sum = {0};
+  int i = 0;
+  for (; i + LANES <= n; i += LANES) {
+    sum -= KERNEL_FN(log)(KERNEL_FN(load)(probs + i));
+  }
+  if (i < n) {
+    // log(1) = 0, so padded lanes don't contribute
+    sum -= KERNEL_FN(log)(KERNEL_FN(load_partial)(probs + i, n - i, 1));
+  }
+  return KERNEL_FN(sum)(sum);
+}
+
+typedef int16_t KERNEL_FN(i16vec) __attribute__((vector_size(KERNEL_BYTES)));
+typedef int32_t KERNEL_FN(i32vec) __attribute__((vector_size(KERNEL_BYTES)));
+
+// Sign-extends the int8 values in the low (shift = 8) or high (shift = 0)
+// half of each 16-bit lane. Compilers lower this to lane shifts, where a
+// conversion from an int8 vector tends to be scalarized.
+#define KERNEL_I8_TO_I16(v, shift) (((v) << (shift)) >> 8)
+#define KERNEL_I16_TO_I32(v, shift) (((v) << (shift)) >> 16)
+
+static KERNEL_ATTR int32_t KERNEL_FN(dot_i8)(const int8_t *a, const int8_t *b,
+                                             int n) {
+  KERNEL_FN(i32vec) sum = {0};
+  int i = 0;
+  for (; i + KERNEL_BYTES <= n; i += KERNEL_BYTES) {
+    KERNEL_FN(i16vec) va, vb;
+    memcpy(&va, a + i, sizeof(va));
+    memcpy(&vb, b + i, sizeof(vb));
+
+    // |a * b| <= 128^2 fits in int16, and pairs of products are then widened
+    // to int32 before accumulating
+    KERNEL_FN(i32vec) low = (KERNEL_FN(i32vec))(KERNEL_I8_TO_I16(va, 8) *
+                                                KERNEL_I8_TO_I16(vb, 8));
+    KERNEL_FN(i32vec) high = (KERNEL_FN(i32vec))(KERNEL_I8_TO_I16(va, 0) *
+                                                 KERNEL_I8_TO_I16(vb, 0));
+    sum += KERNEL_I16_TO_I32(low, 16) + KERNEL_I16_TO_I32(low, 0) +
+           KERNEL_I16_TO_I32(high, 16) + KERNEL_I16_TO_I32(high, 0);
+  }
+
+  int32_t total = 0;
+  for (int j = 0; j < KERNEL_BYTES / 4; j++) {
+    total += sum[j];
+  }
+  for (; i < n; i++) {
+    total += (int32_t)a[i] * b[i];
+  }
+  return total;
+}
+
+#undef KERNEL_I16_TO_I32
+#undef KERNEL_I8_TO_I16
+
+static const Kernels KERNEL_CONCAT(kernels, KERNEL_ISA) = {
+    KERNEL_STRING(KERNEL_ISA),
+    KERNEL_FN(dot),
+    KERNEL_FN(tanh),
+    KERNEL_FN(tanh_fast),
+    KERNEL_FN(softmax),
+    KERNEL_FN(log_softmax),
+    KERNEL_FN(nll_sum),
+    KERNEL_FN(dot_i8),
+};
+
+#undef LANES
+#undef UVEC
+#undef IVEC
+#undef VEC
+#undef KERNEL_ATTR
+#undef KERNEL_FN
+#undef KERNEL_STRING
+#undef KERNEL_STRING_
+#undef KERNEL_CONCAT
+#undef KERNEL_CONCAT_
+#undef KERNEL_BYTES
+#undef KERNEL_TARGET
+#undef KERNEL_ISA
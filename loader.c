@@ -0,0 +1,241 @@
+#include "makemore.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Streams (context, target) examples from a names file in shuffled batches.
+//
+// Memory is capped at buffer_size examples regardless of the corpus size: the
+// file is read a line at a time and examples go through a fixed-size shuffle
+// buffer, which emits a random resident example for every new one read. A
+// producer thread fills one of two batches while the caller trains on the
+// other.
+struct Loader {
+  FILE *stream;
+  int block_size;
+
+  // Only words of this split are read. split_rng is reseeded with split_seed
+  // at the start of every pass.
+  enum Split split;
+  uint64_t split_seed;
+  Rng split_rng;
+
+  // Current word and the position of the next target within it
+  char *line;
+  size_t line_capacity;
+  int word_length;
+  int position;
+  int *context;
+  long epoch;
+  long examples_in_epoch;
+
+  // Shuffle buffer of buffer_size examples, each block_size + 1 tokens
+  int *buffer;
+  int buffer_size;
+  Rng rng;
+
+  Batch batches[2];
+  int ready[2];
+  // Batch currently held by the caller, or -1 before the first loader_next
+  int current;
+  int stop;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  pthread_t thread;
+};
+
+static void loader_read_word(Loader *loader) {
+  while (1) {
+    ssize_t read = getline(&loader->line, &loader->line_capacity,
+                           loader->stream);
+    if (read == -1) {
+      if (loader->examples_in_epoch == 0) {
+        fprintf(stderr, "loader: no words in split\n");
+        exit(1);
+      }
+      loader->epoch++;
+      loader->examples_in_epoch = 0;
+      rewind(loader->stream);
+      rng_seed(&loader->split_rng, loader->split_seed);
+      continue;
+    }
+    if (split_next_word(&loader->split_rng) != loader->split) {
+      continue;
+    }
+
+    // Stop at the newline or any other character outside the alphabet
+    int length = 0;
+    while (loader->line[length] >= 'a' && loader->line[length] <= 'z') {
+      length++;
+    }
+    if (length > 0) {
+      loader->word_length = length;
+      loader->position = 0;
+      memset(loader->context, 0, loader->block_size * sizeof(int));
+      return;
+    }
+  }
+}
+
+// Writes the next example in corpus order as block_size context tokens
+// followed by the target
+static void loader_read_example(Loader *loader, int *example) {
+  if (loader->position > loader->word_length) {
+    loader_read_word(loader);
+  }
+
+  // The target after the last character is the end token
+  int target = 0;
+  if (loader->position < loader->word_length) {
+    target = CHAR_TO_INDEX(loader->line[loader->position]);
+  }
+
+  int block_size = loader->block_size;
+  memcpy(example, loader->context, block_size * sizeof(int));
+  example[block_size] = target;
+
+  memmove(loader->context, loader->context + 1,
+          (block_size - 1) * sizeof(int));
+  loader->context[block_size - 1] = target;
+  loader->position++;
+  loader->examples_in_epoch++;
+}
+
+static void loader_fill(Loader *loader, Batch *batch) {
+  int block_size = loader->block_size;
+  int example_size = block_size + 1;
+
+  for (int i = 0; i < batch->size; i++) {
+    int *example =
+        loader->buffer + (rng_next(&loader->rng) % loader->buffer_size) *
+                             example_size;
+    memcpy(batch->contexts + i * block_size, example,
+           block_size * sizeof(int));
+    batch->targets[i] = example[block_size];
+    loader_read_example(loader, example);
+  }
+  batch->epoch = loader->epoch;
+}
+
+static void *loader_run(void *arg) {
+  Loader *loader = (Loader *)arg;
+
+  int example_size = loader->block_size + 1;
+  for (int i = 0; i < loader->buffer_size; i++) {
+    loader_read_example(loader, loader->buffer + i * example_size);
+  }
+
+  int slot = 0;
+  while (1) {
+    pthread_mutex_lock(&loader->mutex);
+    while (loader->ready[slot] && !loader->stop) {
+      pthread_cond_wait(&loader->cond, &loader->mutex);
+    }
+    int stop = loader->stop;
+    pthread_mutex_unlock(&loader->mutex);
+    if (stop) {
+      break;
+    }
+
+    // The slot isn't ready, so the caller doesn't hold it
+    loader_fill(loader, &loader->batches[slot]);
+
+    pthread_mutex_lock(&loader->mutex);
+    loader->ready[slot] = 1;
+    pthread_cond_broadcast(&loader->cond);
+    pthread_mutex_unlock(&loader->mutex);
+
+    slot ^= 1;
+  }
+  return NULL;
+}
+
+Loader *loader_init(const char *path, enum Split split, uint64_t split_seed,
+                    int block_size, int batch_size, int buffer_size,
+                    uint64_t seed) {
+  Loader *loader = (Loader *)allocate(sizeof(Loader));
+  loader->stream = fopen(path, "r");
+  if (loader->stream == NULL) {
+    exit(1);
+  }
+  loader->block_size = block_size;
+  loader->split = split;
+  loader->split_seed = split_seed;
+  rng_seed(&loader->split_rng, split_seed);
+
+  loader->line = NULL;
+  loader->line_capacity = 0;
+  loader->word_length = 0;
+  // Past the end of the (empty) current word, so the first read loads a word
+  loader->position = 1;
+  loader->context = (int *)allocate(block_size * sizeof(int));
+  loader->epoch = 0;
+  loader->examples_in_epoch = 0;
+
+  loader->buffer =
+      (int *)allocate((size_t)buffer_size * (block_size + 1) * sizeof(int));
+  loader->buffer_size = buffer_size;
+  rng_seed(&loader->rng, seed);
+
+  for (int i = 0; i < 2; i++) {
+    Batch *batch = &loader->batches[i];
+    batch->size = batch_size;
+    batch->block_size = block_size;
+    batch->contexts = (int *)allocate(batch_size * block_size * sizeof(int));
+    batch->targets = (int *)allocate(batch_size * sizeof(int));
+    batch->epoch = 0;
+    loader->ready[i] = 0;
+  }
+  loader->current = -1;
+  loader->stop = 0;
+
+  pthread_mutex_init(&loader->mutex, NULL);
+  pthread_cond_init(&loader->cond, NULL);
+  if (pthread_create(&loader->thread, NULL, loader_run, loader) != 0) {
+    exit(1);
+  }
+  return loader;
+}
+
+// Returns the next batch, which stays valid until the following call. The
+// batch after it is prepared in the background meanwhile.
+Batch *loader_next(Loader *loader) {
+  pthread_mutex_lock(&loader->mutex);
+
+  int slot = 0;
+  if (loader->current >= 0) {
+    loader->ready[loader->current] = 0;
+    pthread_cond_broadcast(&loader->cond);
+    slot = loader->current ^ 1;
+  }
+
+  while (!loader->ready[slot]) {
+    pthread_cond_wait(&loader->cond, &loader->mutex);
+  }
+  loader->current = slot;
+
+  pthread_mutex_unlock(&loader->mutex);
+  return &loader->batches[slot];
+}
+
+void loader_free(Loader *loader) {
+  pthread_mutex_lock(&loader->mutex);
+  loader->stop = 1;
+  pthread_cond_broadcast(&loader->cond);
+  pthread_mutex_unlock(&loader->mutex);
+  pthread_join(loader->thread, NULL);
+
+  pthread_mutex_destroy(&loader->mutex);
+  pthread_cond_destroy(&loader->cond);
+
+  for (int i = 0; i < 2; i++) {
+    free(loader->batches[i].contexts);
+    free(loader->batches[i].targets);
+  }
+  free(loader->buffer);
+  free(loader->context);
+  free(loader->line);
+  fclose(loader->stream);
+  free(loader);
+}
@@ -5,45 +5,162 @@
 #include <string.h>
 #include <time.h>
 
-void test_bigram() {
-  double **bigram = bigram_init();
+// Bigram fitted to the training split of names.txt
+static Scalar **train_bigram(uint64_t seed) {
+  Scalar **bigram = bigram_init();
+  Dataset *train = dataset_load("names.txt", TRAIN, seed);
+  for (int i = 0; i < train->num_words; i++) {
+    bigram_add_word(bigram, train->words[i], strlen(train->words[i]));
+  }
+  dataset_free(train);
+  bigram_normalize(bigram);
+  return bigram;
+}
 
-  {
-    FILE *stream = fopen("names.txt", "r");
-    if (stream == NULL) {
-      exit(1);
-    }
+// Context length of the MLP from init_context_mlp
+#define CONTEXT_BLOCK_SIZE 3
 
-    size_t len = 0;
-    char *line = NULL;
-    ssize_t read;
-    while ((read = getline(&line, &len, stream)) != -1) {
-      bigram_add_word(bigram, line, read - 1);
-    }
-
-    free(line);
-    fclose(stream);
-  }
+// Weights of an untrained MLP mapping CONTEXT_BLOCK_SIZE one-hot tokens
+// through 64 hidden units to ALPHABET_SIZE logits
+static MLPWeights *init_context_mlp(Rng *rng) {
+  int layer_outputs[] = {64, ALPHABET_SIZE};
+  MLP *mlp =
+      mlp_init(CONTEXT_BLOCK_SIZE * ALPHABET_SIZE, layer_outputs, 2, rng);
+  MLPWeights *weights = mlp_weights_init(mlp);
+  mlp_free(mlp);
+  return weights;
+}
 
-  bigram_normalize(bigram);
+void test_bigram() {
+  Scalar **bigram = train_bigram(0);
 
   // bigram_print(bigram);
 
   // Sample from bigram
+  Rng rng;
+  rng_seed(&rng, 0);
   const int num_samples = 10;
   for (int i = 0; i < num_samples; i++) {
-    bigram_sample(bigram);
+    bigram_sample(bigram, &rng);
+  }
+
+  // Batch sampling is reproducible for a given seed and thread count
+  const int num_batch_samples = 1000;
+  const int num_threads = 4;
+  char **words = bigram_sample_batch(bigram, num_batch_samples, num_threads, 0);
+  char **words_again =
+      bigram_sample_batch(bigram, num_batch_samples, num_threads, 0);
+  for (int i = 0; i < num_batch_samples; i++) {
+    if (strcmp(words[i], words_again[i]) != 0) {
+      exit(1);
+    }
+    free(words[i]);
+    free(words_again[i]);
+  }
+  free(words);
+  free(words_again);
+
+  // A thread count below 1 is treated as 1
+  words = bigram_sample_batch(bigram, 10, 1, 0);
+  words_again = bigram_sample_batch(bigram, 10, 0, 0);
+  for (int i = 0; i < 10; i++) {
+    if (strcmp(words[i], words_again[i]) != 0) {
+      exit(1);
+    }
+    free(words[i]);
+    free(words_again[i]);
   }
+  free(words);
+  free(words_again);
 
   char *test_words[] = {"andrejq"};
   double num_test_words =
       (double)sizeof(test_words) / (double)sizeof(test_words[0]);
-  double average_nll = bigram_average_nll(bigram, test_words, num_test_words);
+  Scalar average_nll = bigram_average_nll(bigram, test_words, num_test_words);
   // printf("nll/n = %f\n", average_nll);
 
+  // Dataset evaluation matches bigram_average_nll and doesn't depend on the
+  // thread count
+  LanguageModel *model = bigram_model_init(bigram);
+  Dataset *dev = dataset_load("names.txt", DEV, 0);
+  Evaluation dev_evaluation = evaluate(model, dev, 4);
+  // A thread count below 1 is treated as 1
+  Evaluation single_thread_evaluation = evaluate(model, dev, 0);
+  double expected_nll = bigram_average_nll(bigram, dev->words, dev->num_words);
+  if (fabs(dev_evaluation.nll - expected_nll) > 1e-5 * expected_nll ||
+      fabs(dev_evaluation.nll - single_thread_evaluation.nll) >
+          1e-5 * expected_nll) {
+    exit(1);
+  }
+  dataset_free(dev);
+
+  Dataset *test = dataset_load("names.txt", TEST, 0);
+  Evaluation test_evaluation = evaluate(model, test, 4);
+  dataset_free(test);
+  language_model_free(model);
+
+  printf("dev nll = %f, test nll = %f (%.0f tokens/s)\n", dev_evaluation.nll,
+         test_evaluation.nll, test_evaluation.tokens_per_second);
+
   bigram_free(bigram);
 }
 
+void test_loader() {
+  const int block_size = 3;
+  const int batch_size = 32;
+  const int buffer_size = 4096;
+
+  // Count targets over one pass of the training split, which is all the
+  // loader reads
+  long corpus_counts[ALPHABET_SIZE] = {0};
+  long num_examples = 0;
+  Dataset *train = dataset_load("names.txt", TRAIN, 0);
+  for (int i = 0; i < train->num_words; i++) {
+    char *word = train->words[i];
+    for (int j = 0; word[j] != '\0'; j++) {
+      corpus_counts[CHAR_TO_INDEX(word[j])]++;
+    }
+    corpus_counts[0]++;
+    num_examples += strlen(word) + 1;
+  }
+  dataset_free(train);
+
+  Loader *loader = loader_init("names.txt", TRAIN, 0, block_size, batch_size,
+                               buffer_size, 0);
+
+  long counts[ALPHABET_SIZE] = {0};
+  for (long seen = 0; seen < num_examples; seen += batch_size) {
+    Batch *batch = loader_next(loader);
+    int size = batch->size;
+    if (seen + size > num_examples) {
+      size = num_examples - seen;
+    }
+    for (int i = 0; i < size; i++) {
+      for (int j = 0; j < block_size; j++) {
+        int token = batch->contexts[i * block_size + j];
+        if (token < 0 || token >= ALPHABET_SIZE) {
+          exit(1);
+        }
+      }
+      counts[batch->targets[i]]++;
+    }
+  }
+
+  // Shuffling only moves examples across the pass boundary through the
+  // buffer, so the target counts can differ by at most buffer_size
+  long difference = 0;
+  for (int i = 0; i < ALPHABET_SIZE; i++) {
+    difference += labs(counts[i] - corpus_counts[i]);
+  }
+  printf("%ld examples, %ld targets displaced\n", num_examples,
+         difference / 2);
+  if (difference / 2 > buffer_size) {
+    exit(1);
+  }
+
+  loader_free(loader);
+}
+
 void test_value() {
   Value *x1 = value_init_constant_with_label(2, "x1");
   Value *x2 = value_init_constant_with_label(0, "x2");
@@ -63,7 +180,8 @@ void test_value() {
 }
 
 void test_mlp() {
-  srandom(time(NULL));
+  Rng rng;
+  rng_seed(&rng, time(NULL));
 
   Value *inputs[] = {value_init_constant(2), value_init_constant(3),
                      value_init_constant(-1)};
@@ -72,7 +190,7 @@ void test_mlp() {
   int layer_outputs[] = {2, 1};
   int num_layer_outputs = sizeof(layer_outputs) / sizeof(layer_outputs[0]);
 
-  MLP *mlp = mlp_init(num_inputs, layer_outputs, num_layer_outputs);
+  MLP *mlp = mlp_init(num_inputs, layer_outputs, num_layer_outputs, &rng);
 
   Value **outputs = mlp_apply(mlp, inputs);
 
@@ -219,7 +337,9 @@ void test_mlp_loss() {
       value_init_constant(1),
   };
 
-  MLP *mlp = mlp_init(NUM_INPUTS, layer_outputs, NUM_LAYER_OUTPUTS);
+  Rng rng;
+  rng_seed(&rng, 0);
+  MLP *mlp = mlp_init(NUM_INPUTS, layer_outputs, NUM_LAYER_OUTPUTS, &rng);
 
 #define NUM_TRAINING_RUNS 100
   for (int x = 0; x < NUM_TRAINING_RUNS; x++) {
@@ -274,8 +394,337 @@ void test_mlp_loss() {
   mlp_free(mlp);
 }
 
+void test_eval() {
+  Rng rng;
+  rng_seed(&rng, 0);
+
+  // The graph-free forward matches mlp_apply
+  {
+    Scalar inputs[] = {2, 3, -1};
+    Value *input_values[] = {value_init_constant(inputs[0]),
+                             value_init_constant(inputs[1]),
+                             value_init_constant(inputs[2])};
+    int layer_outputs[] = {4, 4, 1};
+    MLP *mlp = mlp_init(3, layer_outputs, 3, &rng);
+    MLPWeights *weights = mlp_weights_init(mlp);
+
+    Scalar output;
+    mlp_weights_forward(weights, inputs, &output);
+    Value **outputs = mlp_apply(mlp, input_values);
+    if (fabs(output - outputs[0]->data) > 1e-5) {
+      exit(1);
+    }
+
+    mlp_free_outputs(mlp, outputs);
+    for (int i = 0; i < 3; i++) {
+      value_free(input_values[i]);
+    }
+    mlp_weights_free(weights);
+    mlp_free(mlp);
+  }
+
+  const int block_size = CONTEXT_BLOCK_SIZE;
+  MLPWeights *weights = init_context_mlp(&rng);
+  LanguageModel *model = mlp_model_init(weights, block_size);
+
+  // The batched forward over contexts matches the forward on one-hot inputs,
+  // including a partial tile
+  {
+    const int num_contexts = 50;
+    int contexts[num_contexts * block_size];
+    for (int i = 0; i < num_contexts * block_size; i++) {
+      contexts[i] = rng_next(&rng) % ALPHABET_SIZE;
+    }
+    Scalar outputs[num_contexts * ALPHABET_SIZE];
+    mlp_weights_forward_contexts(weights, contexts, num_contexts, block_size,
+                                 outputs);
+
+    for (int i = 0; i < num_contexts; i++) {
+      Scalar inputs[block_size * ALPHABET_SIZE];
+      memset(inputs, 0, sizeof(inputs));
+      for (int j = 0; j < block_size; j++) {
+        inputs[j * ALPHABET_SIZE + contexts[i * block_size + j]] = 1;
+      }
+      Scalar expected[ALPHABET_SIZE];
+      mlp_weights_forward(weights, inputs, expected);
+      for (int j = 0; j < ALPHABET_SIZE; j++) {
+        if (fabs(outputs[i * ALPHABET_SIZE + j] - expected[j]) > 1e-5) {
+          exit(1);
+        }
+      }
+    }
+  }
+
+  Dataset *dev = dataset_load("names.txt", DEV, 0);
+  Evaluation evaluation = evaluate(model, dev, 4);
+  printf("mlp dev nll = %f (%.0f tokens/s)\n", evaluation.nll,
+         evaluation.tokens_per_second);
+
+  // The fast tanh approximation barely moves the NLL
+  weights->fast_tanh = 1;
+  Evaluation fast_evaluation = evaluate(model, dev, 4);
+  printf("mlp dev nll with fast tanh = %f (%.0f tokens/s)\n",
+         fast_evaluation.nll, fast_evaluation.tokens_per_second);
+  dataset_free(dev);
+  if (fabs(fast_evaluation.nll - evaluation.nll) > 1e-3) {
+    exit(1);
+  }
+
+  language_model_free(model);
+  mlp_weights_free(weights);
+}
+
+void test_quantize() {
+  Dataset *dev = dataset_load("names.txt", DEV, 0);
+  Scalar **bigram = train_bigram(0);
+
+  int16_t *quantized_bigram = quantized_bigram_init(bigram);
+  LanguageModel *bigram_model = bigram_model_init(bigram);
+  LanguageModel *quantized_bigram_model =
+      quantized_bigram_model_init(quantized_bigram);
+  double bigram_difference = quantization_report(
+      "bigram", bigram_model, quantized_bigram_model,
+      ALPHABET_SIZE * ALPHABET_SIZE * sizeof(Scalar),
+      ALPHABET_SIZE * ALPHABET_SIZE * sizeof(int16_t), dev, 4);
+
+  Rng rng;
+  rng_seed(&rng, 0);
+  const int block_size = CONTEXT_BLOCK_SIZE;
+  MLPWeights *weights = init_context_mlp(&rng);
+  QuantizedMLP *quantized_mlp = quantized_mlp_init(weights);
+
+  size_t num_bytes = 0;
+  size_t num_quantized_bytes = 0;
+  for (int i = 0; i < weights->num_layers; i++) {
+    int num_outputs = weights->num_outputs[i];
+    num_bytes +=
+        (weights->num_inputs[i] + 1) * num_outputs * sizeof(Scalar);
+    num_quantized_bytes += quantized_mlp->padded_inputs[i] * num_outputs +
+                           2 * num_outputs * sizeof(Scalar);
+  }
+
+  LanguageModel *mlp_model = mlp_model_init(weights, block_size);
+  LanguageModel *quantized_mlp_model =
+      quantized_mlp_model_init(quantized_mlp, block_size);
+  double mlp_difference =
+      quantization_report("mlp", mlp_model, quantized_mlp_model, num_bytes,
+                          num_quantized_bytes, dev, 4);
+
+  language_model_free(quantized_mlp_model);
+  language_model_free(mlp_model);
+  quantized_mlp_free(quantized_mlp);
+  mlp_weights_free(weights);
+
+  language_model_free(quantized_bigram_model);
+  language_model_free(bigram_model);
+  free(quantized_bigram);
+  bigram_free(bigram);
+
+  dataset_free(dev);
+
+  if (fabs(bigram_difference) > 0.01 || fabs(mlp_difference) > 0.01) {
+    exit(1);
+  }
+}
+
+typedef struct GeneratedWords {
+  char **words;
+  int num_words;
+} GeneratedWords;
+
+static void collect_word(const char *word, void *data) {
+  GeneratedWords *generated = (GeneratedWords *)data;
+  int num_chars = strlen(word);
+  char *copy = (char *)allocate(num_chars + 1);
+  memcpy(copy, word, num_chars + 1);
+  generated->words[generated->num_words++] = copy;
+  printf("%s\n", word);
+}
+
+// Generates words and checks they're unique
+static void generate_and_check(LanguageModel *model, GenerateConfig *config,
+                               Rng *rng, int num_words) {
+  GeneratedWords generated;
+  generated.words = (char **)allocate(num_words * sizeof(char *));
+  generated.num_words = 0;
+
+  int num_generated =
+      generate(model, config, rng, num_words, collect_word, &generated);
+  if (num_generated != num_words || generated.num_words != num_words) {
+    exit(1);
+  }
+  for (int i = 0; i < num_words; i++) {
+    for (int j = 0; j < i; j++) {
+      if (strcmp(generated.words[i], generated.words[j]) == 0) {
+        exit(1);
+      }
+    }
+  }
+
+  for (int i = 0; i < num_words; i++) {
+    free(generated.words[i]);
+  }
+  free(generated.words);
+}
+
+void test_generate() {
+  Scalar **bigram = train_bigram(0);
+
+  LanguageModel *model = bigram_model_init(bigram);
+  Rng rng;
+  rng_seed(&rng, 0);
+
+  GenerateConfig config;
+  config.temperature = 0.8;
+  config.top_k = 10;
+  config.top_p = 0.95;
+  config.beam_width = 0;
+  config.batch_size = 64;
+  config.max_chars = 20;
+  generate_and_check(model, &config, &rng, 20);
+
+  printf("\n");
+  config.beam_width = 16;
+  generate_and_check(model, &config, &rng, 10);
+
+  language_model_free(model);
+  bigram_free(bigram);
+
+  // The MLP is untrained, so this only checks the engine works through the
+  // graph-free forward
+  printf("\n");
+  MLPWeights *weights = init_context_mlp(&rng);
+  model = mlp_model_init(weights, CONTEXT_BLOCK_SIZE);
+  config.temperature = 1;
+  config.top_k = 0;
+  config.top_p = 1;
+  config.beam_width = 0;
+  generate_and_check(model, &config, &rng, 5);
+
+  language_model_free(model);
+  mlp_weights_free(weights);
+}
+
+#ifdef MAKEMORE_FLOAT32
+#define KERNEL_TOLERANCE 1e-4
+#else
+#define KERNEL_TOLERANCE 1e-9
+#endif
+
+static Scalar random_uniform(Rng *rng, Scalar lo, Scalar hi) {
+  return lo + (hi - lo) * rng_uniform(rng);
+}
+
+static int check_close(const char *variant, const char *kernel, Scalar actual,
+                       Scalar expected, Scalar scale) {
+  if (fabs(actual - expected) > KERNEL_TOLERANCE * scale) {
+    printf("%s %s: got %.10f, expected %.10f\n", variant, kernel, actual,
+           expected);
+    return 0;
+  }
+  return 1;
+}
+
+void test_kernels() {
+  const Kernels *variants[KERNELS_MAX_VARIANTS];
+  int num_variants = kernels_available(variants);
+
+  // Odd sizes exercise the partial-vector tails
+  int sizes[] = {1, 3, 7, 16, 27, 33, 100, 1000};
+  int num_sizes = sizeof(sizes) / sizeof(sizes[0]);
+
+  Rng rng;
+  rng_seed(&rng, 0);
+
+  int ok = 1;
+  for (int s = 0; s < num_sizes; s++) {
+    int n = sizes[s];
+    Scalar *a = (Scalar *)allocate(n * sizeof(Scalar));
+    Scalar *b = (Scalar *)allocate(n * sizeof(Scalar));
+    Scalar *expected = (Scalar *)allocate(n * sizeof(Scalar));
+    Scalar *actual = (Scalar *)allocate(n * sizeof(Scalar));
+    int8_t *a_i8 = (int8_t *)allocate(n);
+    int8_t *b_i8 = (int8_t *)allocate(n);
+
+    for (int i = 0; i < n; i++) {
+      a[i] = random_uniform(&rng, -5, 5);
+      b[i] = random_uniform(&rng, 0.0001, 1);
+      a_i8[i] = (int8_t)(rng_next(&rng) % 255 - 127);
+      b_i8[i] = (int8_t)(rng_next(&rng) % 255 - 127);
+    }
+
+    Scalar dot_scale = 0;
+    for (int i = 0; i < n; i++) {
+      dot_scale += fabs(a[i] * b[i]);
+    }
+    Scalar expected_dot = kernels_scalar.dot(a, b, n);
+    Scalar expected_nll = kernels_scalar.nll_sum(b, n);
+    int32_t expected_dot_i8 = kernels_scalar.dot_i8(a_i8, b_i8, n);
+
+    for (int v = 0; v < num_variants; v++) {
+      const Kernels *variant = variants[v];
+
+      ok &= check_close(variant->name, "dot", variant->dot(a, b, n),
+                        expected_dot, dot_scale);
+
+      ok &= check_close(variant->name, "nll_sum", variant->nll_sum(b, n),
+                        expected_nll, expected_nll);
+
+      // Integer dot products are exact
+      int32_t dot_i8 = variant->dot_i8(a_i8, b_i8, n);
+      if (dot_i8 != expected_dot_i8) {
+        printf("%s dot_i8: got %d, expected %d\n", variant->name, dot_i8,
+               expected_dot_i8);
+        ok = 0;
+      }
+
+      kernels_scalar.tanh(expected, a, n);
+      variant->tanh(actual, a, n);
+      for (int i = 0; i < n; i++) {
+        ok &= check_close(variant->name, "tanh", actual[i], expected[i], 1);
+      }
+
+      // tanh_fast is checked against the exact tanh with its own error bound
+      variant->tanh_fast(actual, a, n);
+      for (int i = 0; i < n; i++) {
+        ok &= check_close(variant->name, "tanh_fast", actual[i], expected[i],
+                          1e-4 / KERNEL_TOLERANCE);
+      }
+
+      kernels_scalar.log_softmax(expected, a, n);
+      variant->log_softmax(actual, a, n);
+      for (int i = 0; i < n; i++) {
+        ok &= check_close(variant->name, "log_softmax", actual[i], expected[i],
+                          fabs(expected[i]) + 1);
+      }
+
+      kernels_scalar.softmax(expected, a, n);
+      variant->softmax(actual, a, n);
+      for (int i = 0; i < n; i++) {
+        ok &= check_close(variant->name, "softmax", actual[i], expected[i],
+                          expected[i]);
+      }
+    }
+
+    free(a);
+    free(b);
+    free(expected);
+    free(actual);
+    free(a_i8);
+    free(b_i8);
+  }
+
+  for (int v = 0; v < num_variants; v++) {
+    printf("%s\n", variants[v]->name);
+  }
+
+  if (!ok) {
+    exit(1);
+  }
+}
+
 int main(int argc, char *argv[]) {
-  srand(0);
+  kernels_init();
 
   char *type = NULL;
   for (int i = 1; i < argc; i++) {
@@ -287,6 +736,16 @@ int main(int argc, char *argv[]) {
 
   if (type != NULL && (strcmp(type, "bigram") == 0)) {
     test_bigram();
+  } else if (type != NULL && (strcmp(type, "generate") == 0)) {
+    test_generate();
+  } else if (type != NULL && (strcmp(type, "quantize") == 0)) {
+    test_quantize();
+  } else if (type != NULL && (strcmp(type, "eval") == 0)) {
+    test_eval();
+  } else if (type != NULL && (strcmp(type, "loader") == 0)) {
+    test_loader();
+  } else if (type != NULL && (strcmp(type, "kernels") == 0)) {
+    test_kernels();
   } else {
     test_mlp_loss();
   }
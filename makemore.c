@@ -1,7 +1,9 @@
 #include "makemore.h"
 #include <math.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 void *allocate(size_t size) {
   void *result = malloc(size);
@@ -11,15 +13,178 @@ void *allocate(size_t size) {
   return result;
 }
 
-// 26 + "."
-#define ALPHABET_SIZE 27
-#define CHAR_TO_INDEX(char) (char - 'a' + 1)
-#define INDEX_TO_CHAR(index) ('a' + index - 1)
+static uint64_t rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
 
-double **bigram_init() {
-  double **bigram = (double **)allocate(ALPHABET_SIZE * sizeof(double *));
+static uint64_t splitmix64(uint64_t *state) {
+  uint64_t z = (*state += 0x9e3779b97f4a7c15);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+  return z ^ (z >> 31);
+}
+
+void rng_seed(Rng *rng, uint64_t seed) {
+  // Expand the seed with splitmix64 so the state is never all zeros
+  for (int i = 0; i < 4; i++) {
+    rng->s[i] = splitmix64(&seed);
+  }
+}
+
+uint64_t rng_next(Rng *rng) {
+  uint64_t *s = rng->s;
+  uint64_t result = rotl(s[1] * 5, 7) * 9;
+  uint64_t t = s[1] << 17;
+
+  s[2] ^= s[0];
+  s[3] ^= s[1];
+  s[1] ^= s[2];
+  s[0] ^= s[3];
+  s[2] ^= t;
+  s[3] = rotl(s[3], 45);
+
+  return result;
+}
+
+// Uniform in [0, 1) using as many random bits as Scalar's mantissa holds
+Scalar rng_uniform(Rng *rng) {
+#ifdef MAKEMORE_FLOAT32
+  return (rng_next(rng) >> 40) * 0x1.0p-24f;
+#else
+  return (rng_next(rng) >> 11) * 0x1.0p-53;
+#endif
+}
+
+void rng_jump(Rng *rng) {
+  static const uint64_t jump[] = {0x180ec6d33cfd0aba, 0xd5a61266f0c9392c,
+                                  0xa9582618e03fc9aa, 0x39abdc4529b1661c};
+
+  uint64_t s[4] = {0, 0, 0, 0};
+  for (int i = 0; i < 4; i++) {
+    for (int b = 0; b < 64; b++) {
+      if (jump[i] & ((uint64_t)1 << b)) {
+        for (int j = 0; j < 4; j++) {
+          s[j] ^= rng->s[j];
+        }
+      }
+      rng_next(rng);
+    }
+  }
+
+  for (int j = 0; j < 4; j++) {
+    rng->s[j] = s[j];
+  }
+}
+
+static Scalar dot_scalar(const Scalar *a, const Scalar *b, int n) {
+  Scalar sum = 0;
+  for (int i = 0; i < n; i++) {
+    sum += a[i] * b[i];
+  }
+  return sum;
+}
+
+static void tanh_scalar(Scalar *out, const Scalar *in, int n) {
+  for (int i = 0; i < n; i++) {
+    out[i] = SCALAR_TANH(in[i]);
+  }
+}
+
+// [7/6] Pade approximant of tanh, see TANH_FAST_CLAMP
+static Scalar tanh_fast(Scalar x) {
+  if (x > TANH_FAST_CLAMP) {
+    x = TANH_FAST_CLAMP;
+  } else if (x < -TANH_FAST_CLAMP) {
+    x = -TANH_FAST_CLAMP;
+  }
+  Scalar x2 = x * x;
+  return x * (135135 + x2 * (17325 + x2 * (378 + x2))) /
+         (135135 + x2 * (62370 + x2 * (3150 + x2 * 28)));
+}
+
+static void tanh_fast_scalar(Scalar *out, const Scalar *in, int n) {
+  for (int i = 0; i < n; i++) {
+    out[i] = tanh_fast(in[i]);
+  }
+}
+
+static void softmax_scalar(Scalar *out, const Scalar *in, int n) {
+  Scalar max = in[0];
+  for (int i = 1; i < n; i++) {
+    if (in[i] > max) {
+      max = in[i];
+    }
+  }
+
+  Scalar sum = 0;
+  for (int i = 0; i < n; i++) {
+    out[i] = SCALAR_EXP(in[i] - max);
+    sum += out[i];
+  }
+  for (int i = 0; i < n; i++) {
+    out[i] /= sum;
+  }
+}
+
+static void log_softmax_scalar(Scalar *out, const Scalar *in, int n) {
+  // log_softmax(x) = x - max - log(sum(exp(x - max)))
+  Scalar max = in[0];
+  for (int i = 1; i < n; i++) {
+    if (in[i] > max) {
+      max = in[i];
+    }
+  }
+
+  Scalar sum = 0;
+  for (int i = 0; i < n; i++) {
+    sum += SCALAR_EXP(in[i] - max);
+  }
+  Scalar log_sum = max + SCALAR_LOG(sum);
+  for (int i = 0; i < n; i++) {
+    out[i] = in[i] - log_sum;
+  }
+}
+
+static Scalar nll_sum_scalar(const Scalar *probs, int n) {
+  Scalar sum = 0;
+  for (int i = 0; i < n; i++) {
+    sum -= SCALAR_LOG(probs[i]);
+  }
+  return sum;
+}
+
+static int32_t dot_i8_scalar(const int8_t *a, const int8_t *b, int n) {
+  int32_t sum = 0;
+  for (int i = 0; i < n; i++) {
+    sum += (int32_t)a[i] * b[i];
+  }
+  return sum;
+}
+
+const Kernels kernels_scalar = {
+    "scalar",
+    dot_scalar,
+    tanh_scalar,
+    tanh_fast_scalar,
+    softmax_scalar,
+    log_softmax_scalar,
+    nll_sum_scalar,
+    dot_i8_scalar,
+};
+
+Kernels kernels = {
+    "scalar",
+    dot_scalar,
+    tanh_scalar,
+    tanh_fast_scalar,
+    softmax_scalar,
+    log_softmax_scalar,
+    nll_sum_scalar,
+    dot_i8_scalar,
+};
+
+Scalar **bigram_init() {
+  Scalar **bigram = (Scalar **)allocate(ALPHABET_SIZE * sizeof(Scalar *));
   for (int i = 0; i < ALPHABET_SIZE; i++) {
-    bigram[i] = (double *)allocate(ALPHABET_SIZE * sizeof(double));
+    bigram[i] = (Scalar *)allocate(ALPHABET_SIZE * sizeof(Scalar));
     for (int j = 0; j < ALPHABET_SIZE; j++) {
       bigram[i][j] = 0;
     }
@@ -27,7 +192,7 @@ double **bigram_init() {
   return bigram;
 }
 
-void bigram_add_word(double **bigram, char *word, int num_chars) {
+void bigram_add_word(Scalar **bigram, char *word, int num_chars) {
   // start token and first character
   bigram[0][CHAR_TO_INDEX(word[0])] += 1;
 
@@ -40,7 +205,7 @@ void bigram_add_word(double **bigram, char *word, int num_chars) {
   bigram[CHAR_TO_INDEX(word[num_chars - 1])][0] += 1;
 }
 
-void bigram_normalize(double **bigram) {
+void bigram_normalize(Scalar **bigram) {
   // Add 1
   for (int i = 0; i < ALPHABET_SIZE; i++) {
     for (int j = 0; j < ALPHABET_SIZE; j++) {
@@ -60,7 +225,7 @@ void bigram_normalize(double **bigram) {
   }
 }
 
-void bigram_print(double **bigram) {
+void bigram_print(Scalar **bigram) {
   for (int i = 0; i < ALPHABET_SIZE; i++) {
     for (int j = 0; j < ALPHABET_SIZE; j++) {
       printf("%.5f ", bigram[i][j]);
@@ -69,78 +234,162 @@ void bigram_print(double **bigram) {
   }
 }
 
-void bigram_free(double **bigram) {
+void bigram_free(Scalar **bigram) {
   for (int i = 0; i < ALPHABET_SIZE; i++) {
     free(bigram[i]);
   }
   free(bigram);
 }
 
-static int sample_multinomial(double *values, int size);
+static int sample_multinomial(Scalar *values, int size, Rng *rng);
+
+char *bigram_sample_word(Scalar **bigram, Rng *rng) {
+  int capacity = 16;
+  int num_chars = 0;
+  char *word = (char *)allocate(capacity);
 
-void bigram_sample(double **bigram) {
   int index = 0;
   while (1) {
-    double *row = bigram[index];
-    index = sample_multinomial(row, ALPHABET_SIZE);
+    Scalar *row = bigram[index];
+    index = sample_multinomial(row, ALPHABET_SIZE, rng);
     if (index == 0) {
       break;
     }
-    printf("%c", INDEX_TO_CHAR(index));
+    if (num_chars + 1 == capacity) {
+      capacity *= 2;
+      word = (char *)realloc(word, capacity);
+      if (word == NULL) {
+        exit(1);
+      }
+    }
+    word[num_chars++] = INDEX_TO_CHAR(index);
   }
-  printf("\n");
+  word[num_chars] = '\0';
+  return word;
 }
 
-double bigram_average_nll(double **bigram, char **words, int num_words) {
-  double log_likelihood = 0;
-  double n = 0;
+void bigram_sample(Scalar **bigram, Rng *rng) {
+  char *word = bigram_sample_word(bigram, rng);
+  printf("%s\n", word);
+  free(word);
+}
 
-  for (int i = 0; i < num_words; i++) {
-    char *word = words[i];
+typedef struct BigramSampleTask {
+  Scalar **bigram;
+  char **words;
+  int num_words;
+  Rng rng;
+} BigramSampleTask;
 
-    // start token and first character
-    log_likelihood += log(bigram[0][CHAR_TO_INDEX(word[0])]);
+static void *bigram_sample_task(void *arg) {
+  // Tasks sit next to each other in one array, so work on local copies rather
+  // than writing the rng state into a cache line the next thread reads
+  BigramSampleTask *task = (BigramSampleTask *)arg;
+  Scalar **bigram = task->bigram;
+  char **words = task->words;
+  int num_words = task->num_words;
+  Rng rng = task->rng;
 
-    // middle characters
-    int i;
-    for (i = 1; word[i] != '\0'; i++) {
-      log_likelihood +=
-          log(bigram[CHAR_TO_INDEX(word[i - 1])][CHAR_TO_INDEX(word[i])]);
+  for (int i = 0; i < num_words; i++) {
+    words[i] = bigram_sample_word(bigram, &rng);
+  }
+  return NULL;
+}
+
+char **bigram_sample_batch(Scalar **bigram, int num_words, int num_threads,
+                           uint64_t seed) {
+  if (num_threads < 1) {
+    num_threads = 1;
+  }
+  char **words = (char **)allocate(num_words * sizeof(char *));
+  BigramSampleTask *tasks =
+      (BigramSampleTask *)allocate(num_threads * sizeof(BigramSampleTask));
+  pthread_t *threads = (pthread_t *)allocate(num_threads * sizeof(pthread_t));
+
+  // Thread t samples a contiguous range of words from the seed's stream jumped
+  // t times, so the output depends only on the seed and the thread count
+  Rng rng;
+  rng_seed(&rng, seed);
+  int start = 0;
+  for (int t = 0; t < num_threads; t++) {
+    int count = num_words / num_threads + (t < num_words % num_threads);
+    tasks[t].bigram = bigram;
+    tasks[t].words = words + start;
+    tasks[t].num_words = count;
+    tasks[t].rng = rng;
+    rng_jump(&rng);
+    start += count;
+
+    if (pthread_create(&threads[t], NULL, bigram_sample_task, &tasks[t]) !=
+        0) {
+      exit(1);
     }
+  }
+
+  for (int t = 0; t < num_threads; t++) {
+    pthread_join(threads[t], NULL);
+  }
+
+  free(threads);
+  free(tasks);
+  return words;
+}
 
-    // last character and end token
-    log_likelihood += log(bigram[CHAR_TO_INDEX(word[i - 2])][0]);
+// Probabilities collected per nll_sum call in bigram_average_nll
+#define BIGRAM_NLL_BUFFER_SIZE 256
 
-    // i + 1 is the number of sequences in word with length i
-    n += i + 1;
+Scalar bigram_average_nll(Scalar **bigram, char **words, int num_words) {
+  // Accumulate in double so long corpora don't lose precision in float32 builds
+  double nll = 0;
+  double n = 0;
+
+  Scalar probs[BIGRAM_NLL_BUFFER_SIZE];
+  int num_probs = 0;
+
+  for (int i = 0; i < num_words; i++) {
+    char *word = words[i];
+    int num_chars = strlen(word);
+
+    // num_chars + 1 is the number of sequences in a word with num_chars
+    // characters. Index 0 is both the start and the end token.
+    int previous = 0;
+    for (int j = 0; j <= num_chars; j++) {
+      int next = j < num_chars ? CHAR_TO_INDEX(word[j]) : 0;
+      probs[num_probs++] = bigram[previous][next];
+      previous = next;
+
+      if (num_probs == BIGRAM_NLL_BUFFER_SIZE) {
+        nll += kernels.nll_sum(probs, num_probs);
+        num_probs = 0;
+      }
+    }
+    n += num_chars + 1;
   }
-  double nll = -log_likelihood;
+  nll += kernels.nll_sum(probs, num_probs);
   return nll / n;
 }
 
-static int sample_multinomial(double *values, int size) {
-  double *cumulatives = (double *)allocate(size * sizeof(double));
-
-  cumulatives[0] = values[0];
-  for (int i = 1; i < size; i++) {
-    cumulatives[i] = cumulatives[i - 1] + values[i];
+static int sample_multinomial(Scalar *values, int size, Rng *rng) {
+  Scalar total = 0;
+  for (int i = 0; i < size; i++) {
+    total += values[i];
   }
 
   // Get random number up to total
-  double total = cumulatives[size - 1];
-  double random_num = (float)rand() / RAND_MAX * total;
+  Scalar random_num = rng_uniform(rng) * total;
 
   // Get index of first cumulative value exceeding random number
-  int index = 0;
-  while (index < size && random_num >= cumulatives[index]) {
-    index++;
+  Scalar cumulative = 0;
+  for (int i = 0; i < size; i++) {
+    cumulative += values[i];
+    if (random_num < cumulative) {
+      return i;
+    }
   }
-
-  free(cumulatives);
-  return index;
+  return size - 1;
 }
 
-static Value *value_init(double data, enum ValueType type) {
+static Value *value_init(Scalar data, enum ValueType type) {
   Value *value = (Value *)allocate(sizeof(Value));
   value->data = data;
   value->label = NULL;
@@ -151,15 +400,15 @@ static Value *value_init(double data, enum ValueType type) {
   return value;
 }
 
-Value *value_init_constant(double data) { return value_init(data, CONSTANT); }
+Value *value_init_constant(Scalar data) { return value_init(data, CONSTANT); }
 
-Value *value_init_constant_with_label(double data, char *label) {
+Value *value_init_constant_with_label(Scalar data, char *label) {
   Value *value = value_init_constant(data);
   value->label = label;
   return value;
 }
 
-static Value *value_init_binary(double data, enum ValueType type,
+static Value *value_init_binary(Scalar data, enum ValueType type,
                                 Value *leftChild, Value *rightChild) {
   Value *value = value_init(data, type);
   value->left_child = leftChild;
@@ -167,7 +416,7 @@ static Value *value_init_binary(double data, enum ValueType type,
   return value;
 }
 
-static Value *value_init_unary(double data, enum ValueType type, Value *child) {
+static Value *value_init_unary(Scalar data, enum ValueType type, Value *child) {
   Value *value = value_init(data, type);
   value->left_child = child;
   return value;
@@ -191,11 +440,12 @@ Value *value_minus(Value *value1, Value *value2) {
 }
 
 Value *value_tanh(Value *value) {
-  return value_init_unary(tanh(value->data), TANH, value);
+  return value_init_unary(SCALAR_TANH(value->data), TANH, value);
 }
 
 Value *value_pow(Value *value, Value *power) {
-  return value_init_binary(pow(value->data, power->data), POW, value, power);
+  return value_init_binary(SCALAR_POW(value->data, power->data), POW, value,
+                           power);
 }
 
 static void value_backward(Value *value) {
@@ -214,15 +464,15 @@ static void value_backward(Value *value) {
     break;
   }
   case TANH: {
-    double d = value->left_child->data;
-    double t = (exp(2 * d) - 1) / (exp(2 * d) + 1);
-    value->left_child->grad += (1 - pow(t, 2)) * value->grad;
+    // d/dx tanh(x) = 1 - tanh(x)^2, and tanh(x) is this node's output
+    Scalar t = value->data;
+    value->left_child->grad += (1 - t * t) * value->grad;
     break;
   }
   case POW: {
     value->left_child->grad +=
         value->right_child->data *
-        pow(value->left_child->data, value->right_child->data - 1) *
+        SCALAR_POW(value->left_child->data, value->right_child->data - 1) *
         value->grad;
     break;
   }
@@ -366,18 +616,16 @@ void value_free(Value *value) {
   free(value);
 }
 
-static double random_weight() {
-  return ((double)random() * 2 / (double)RAND_MAX) - 1;
-}
+static Scalar random_weight(Rng *rng) { return rng_uniform(rng) * 2 - 1; }
 
-Neuron *neuron_init(int num_inputs) {
+Neuron *neuron_init(int num_inputs, Rng *rng) {
   Neuron *neuron = (Neuron *)allocate(sizeof(Neuron));
   neuron->num_inputs = num_inputs;
-  neuron->b = value_init_constant_with_label(random_weight(), "b");
+  neuron->b = value_init_constant_with_label(random_weight(rng), "b");
 
   Value **w = (Value **)allocate(num_inputs * sizeof(Value));
   for (int i = 0; i < num_inputs; i++) {
-    w[i] = value_init_constant_with_label(random_weight(), "w");
+    w[i] = value_init_constant_with_label(random_weight(rng), "w");
   }
   neuron->w = w;
   return neuron;
@@ -410,13 +658,13 @@ Value *neuron_apply(Neuron *neuron, Value **inputs) {
   return value_tanh(activation);
 }
 
-Layer *layer_init(int num_inputs, int num_outputs) {
+Layer *layer_init(int num_inputs, int num_outputs, Rng *rng) {
   Layer *layer = (Layer *)allocate(sizeof(Layer));
   layer->num_inputs = num_inputs;
   layer->num_outputs = num_outputs;
   layer->neurons = (Neuron **)allocate(num_outputs * sizeof(Neuron *));
   for (int i = 0; i < num_outputs; i++) {
-    layer->neurons[i] = neuron_init(num_inputs);
+    layer->neurons[i] = neuron_init(num_inputs, rng);
   }
   return layer;
 }
@@ -437,15 +685,17 @@ Value **layer_apply(Layer *layer, Value **inputs) {
   return outputs;
 }
 
-MLP *mlp_init(int num_inputs, int *layer_outputs, int num_layer_outputs) {
+MLP *mlp_init(int num_inputs, int *layer_outputs, int num_layer_outputs,
+              Rng *rng) {
   MLP *mlp = (MLP *)allocate(sizeof(MLP));
   mlp->num_layers = num_layer_outputs;
   mlp->layers = (Layer **)allocate(num_layer_outputs * sizeof(Layer *));
   for (int i = 0; i < num_layer_outputs; i++) {
     if (i == 0) {
-      mlp->layers[i] = layer_init(num_inputs, layer_outputs[0]);
+      mlp->layers[i] = layer_init(num_inputs, layer_outputs[0], rng);
     } else {
-      mlp->layers[i] = layer_init(layer_outputs[i - 1], layer_outputs[i]);
+      mlp->layers[i] =
+          layer_init(layer_outputs[i - 1], layer_outputs[i], rng);
     }
   }
   return mlp;
@@ -472,3 +722,172 @@ void mlp_free(MLP *mlp) {
   free(mlp->layers);
   free(mlp);
 }
+
+MLPWeights *mlp_weights_init(MLP *mlp) {
+  MLPWeights *weights = (MLPWeights *)allocate(sizeof(MLPWeights));
+  int num_layers = mlp->num_layers;
+  weights->num_layers = num_layers;
+  weights->num_inputs = (int *)allocate(num_layers * sizeof(int));
+  weights->num_outputs = (int *)allocate(num_layers * sizeof(int));
+  weights->weights = (Scalar **)allocate(num_layers * sizeof(Scalar *));
+  weights->biases = (Scalar **)allocate(num_layers * sizeof(Scalar *));
+  weights->max_width = 0;
+  weights->fast_tanh = 0;
+
+  for (int i = 0; i < num_layers; i++) {
+    Layer *layer = mlp->layers[i];
+    int num_inputs = layer->num_inputs;
+    int num_outputs = layer->num_outputs;
+    weights->num_inputs[i] = num_inputs;
+    weights->num_outputs[i] = num_outputs;
+    if (num_inputs > weights->max_width) {
+      weights->max_width = num_inputs;
+    }
+    if (num_outputs > weights->max_width) {
+      weights->max_width = num_outputs;
+    }
+
+    Scalar *w = (Scalar *)allocate(num_outputs * num_inputs * sizeof(Scalar));
+    Scalar *b = (Scalar *)allocate(num_outputs * sizeof(Scalar));
+    for (int j = 0; j < num_outputs; j++) {
+      Neuron *neuron = layer->neurons[j];
+      for (int k = 0; k < num_inputs; k++) {
+        w[j * num_inputs + k] = neuron->w[k]->data;
+      }
+      b[j] = neuron->b->data;
+    }
+    weights->weights[i] = w;
+    weights->biases[i] = b;
+  }
+
+  int num_inputs = weights->num_inputs[0];
+  int num_outputs = weights->num_outputs[0];
+  weights->first_layer_columns =
+      (Scalar *)allocate(num_inputs * num_outputs * sizeof(Scalar));
+  for (int j = 0; j < num_outputs; j++) {
+    for (int k = 0; k < num_inputs; k++) {
+      weights->first_layer_columns[k * num_outputs + j] =
+          weights->weights[0][j * num_inputs + k];
+    }
+  }
+  return weights;
+}
+
+// Same result as mlp_apply, without building a graph
+void mlp_weights_forward(MLPWeights *weights, const Scalar *inputs,
+                         Scalar *outputs) {
+  Scalar *buffers[2];
+  buffers[0] = (Scalar *)allocate(weights->max_width * sizeof(Scalar));
+  buffers[1] = (Scalar *)allocate(weights->max_width * sizeof(Scalar));
+
+  const Scalar *layer_inputs = inputs;
+  for (int i = 0; i < weights->num_layers; i++) {
+    int num_inputs = weights->num_inputs[i];
+    int num_outputs = weights->num_outputs[i];
+    Scalar *layer_outputs =
+        i == weights->num_layers - 1 ? outputs : buffers[i % 2];
+
+    for (int j = 0; j < num_outputs; j++) {
+      layer_outputs[j] = kernels.dot(weights->weights[i] + j * num_inputs,
+                                     layer_inputs, num_inputs) +
+                         weights->biases[i][j];
+    }
+    if (weights->fast_tanh) {
+      kernels.tanh_fast(layer_outputs, layer_outputs, num_outputs);
+    } else {
+      kernels.tanh(layer_outputs, layer_outputs, num_outputs);
+    }
+    layer_inputs = layer_outputs;
+  }
+
+  free(buffers[0]);
+  free(buffers[1]);
+}
+
+// Contexts per tile in mlp_weights_forward_contexts. Keeps the activations of
+// a tile in L1 and the scratch buffers small however large the batch is.
+#define MLP_FORWARD_TILE 32
+
+static void mlp_weights_forward_tile(MLPWeights *weights, const int *contexts,
+                                     int num_contexts, int block_size,
+                                     Scalar *outputs, Scalar **buffers) {
+  int num_layers = weights->num_layers;
+  for (int i = 0; i < num_layers; i++) {
+    int num_inputs = weights->num_inputs[i];
+    int num_outputs = weights->num_outputs[i];
+    const Scalar *w = weights->weights[i];
+    const Scalar *b = weights->biases[i];
+    const Scalar *layer_inputs = buffers[(i + 1) % 2];
+    Scalar *layer_outputs = i == num_layers - 1 ? outputs : buffers[i % 2];
+
+    if (i == 0) {
+      // Only block_size inputs are 1 and the rest are 0, so the outputs are
+      // the biases plus the weights of the active inputs
+      for (int c = 0; c < num_contexts; c++) {
+        Scalar *out = layer_outputs + c * num_outputs;
+        memcpy(out, b, num_outputs * sizeof(Scalar));
+        for (int k = 0; k < block_size; k++) {
+          const Scalar *column =
+              weights->first_layer_columns +
+              (k * ALPHABET_SIZE + contexts[c * block_size + k]) * num_outputs;
+          for (int j = 0; j < num_outputs; j++) {
+            out[j] += column[j];
+          }
+        }
+      }
+    } else {
+      // Each row of weights is applied to every context in the tile while
+      // it's in cache
+      for (int j = 0; j < num_outputs; j++) {
+        const Scalar *row = w + j * num_inputs;
+        for (int c = 0; c < num_contexts; c++) {
+          layer_outputs[c * num_outputs + j] =
+              kernels.dot(row, layer_inputs + c * num_inputs, num_inputs) +
+              b[j];
+        }
+      }
+    }
+
+    // One call covers the whole tile
+    if (weights->fast_tanh) {
+      kernels.tanh_fast(layer_outputs, layer_outputs,
+                        num_contexts * num_outputs);
+    } else {
+      kernels.tanh(layer_outputs, layer_outputs, num_contexts * num_outputs);
+    }
+  }
+}
+
+void mlp_weights_forward_contexts(MLPWeights *weights, const int *contexts,
+                                  int num_contexts, int block_size,
+                                  Scalar *outputs) {
+  Scalar *buffers[2];
+  for (int i = 0; i < 2; i++) {
+    buffers[i] = (Scalar *)allocate(MLP_FORWARD_TILE * weights->max_width *
+                                    sizeof(Scalar));
+  }
+
+  int num_logits = weights->num_outputs[weights->num_layers - 1];
+  for (int c = 0; c < num_contexts; c += MLP_FORWARD_TILE) {
+    int count = num_contexts - c < MLP_FORWARD_TILE ? num_contexts - c
+                                                    : MLP_FORWARD_TILE;
+    mlp_weights_forward_tile(weights, contexts + c * block_size, count,
+                             block_size, outputs + c * num_logits, buffers);
+  }
+
+  free(buffers[0]);
+  free(buffers[1]);
+}
+
+void mlp_weights_free(MLPWeights *weights) {
+  for (int i = 0; i < weights->num_layers; i++) {
+    free(weights->weights[i]);
+    free(weights->biases[i]);
+  }
+  free(weights->weights);
+  free(weights->biases);
+  free(weights->first_layer_columns);
+  free(weights->num_inputs);
+  free(weights->num_outputs);
+  free(weights);
+}
@@ -1,28 +1,123 @@
+#include <stdint.h>
 #include <stdlib.h>
 
+// Scalar type used for all storage and math. Selected at build time with the
+// MAKEMORE_FLOAT32 CMake option.
+#ifdef MAKEMORE_FLOAT32
+typedef float Scalar;
+#define SCALAR_EXP expf
+#define SCALAR_LOG logf
+#define SCALAR_POW powf
+#define SCALAR_TANH tanhf
+#else
+typedef double Scalar;
+#define SCALAR_EXP exp
+#define SCALAR_LOG log
+#define SCALAR_POW pow
+#define SCALAR_TANH tanh
+#endif
+
 void *allocate(size_t size);
 
-double **bigram_init();
-void bigram_add_word(double **bigram, char *word, int num_chars);
-void bigram_print(double **bigram);
-void bigram_normalize(double **bigram);
-void bigram_sample(double **bigram);
-double bigram_average_nll(double **bigram, char **words, int num_words);
-void bigram_free(double **bigram);
+// xoshiro256** generator. Each Rng is an independent stream; rng_jump()
+// advances a stream by 2^128 steps, so jumped copies of one seed never
+// overlap and can be handed to separate threads.
+typedef struct Rng {
+  uint64_t s[4];
+} Rng;
+
+void rng_seed(Rng *rng, uint64_t seed);
+uint64_t rng_next(Rng *rng);
+Scalar rng_uniform(Rng *rng);
+void rng_jump(Rng *rng);
+
+// Vectorizable kernels. `kernels` starts out bound to the scalar reference
+// implementations and kernels_init() rebinds it to the best variant the CPU
+// supports.
+typedef struct Kernels {
+  const char *name;
+  Scalar (*dot)(const Scalar *a, const Scalar *b, int n);
+  void (*tanh)(Scalar *out, const Scalar *in, int n);
+  // Rational approximation of tanh, within 1e-4 of the exact value
+  void (*tanh_fast)(Scalar *out, const Scalar *in, int n);
+  void (*softmax)(Scalar *out, const Scalar *in, int n);
+  // out = in - log(sum(exp(in))), computed stably. out may alias in.
+  void (*log_softmax)(Scalar *out, const Scalar *in, int n);
+  Scalar (*nll_sum)(const Scalar *probs, int n);
+  int32_t (*dot_i8)(const int8_t *a, const int8_t *b, int n);
+} Kernels;
+
+#define KERNELS_MAX_VARIANTS 4
+
+// The tanh_fast approximant reaches 1 here, so inputs are clamped to
+// [-TANH_FAST_CLAMP, TANH_FAST_CLAMP]
+#define TANH_FAST_CLAMP 4.97
+
+extern Kernels kernels;
+extern const Kernels kernels_scalar;
+
+void kernels_init();
+int kernels_available(const Kernels **variants);
+
+// 26 + "."
+#define ALPHABET_SIZE 27
+#define CHAR_TO_INDEX(char) (char - 'a' + 1)
+#define INDEX_TO_CHAR(index) ('a' + index - 1)
+
+Scalar **bigram_init();
+void bigram_add_word(Scalar **bigram, char *word, int num_chars);
+void bigram_print(Scalar **bigram);
+void bigram_normalize(Scalar **bigram);
+char *bigram_sample_word(Scalar **bigram, Rng *rng);
+void bigram_sample(Scalar **bigram, Rng *rng);
+char **bigram_sample_batch(Scalar **bigram, int num_words, int num_threads,
+                           uint64_t seed);
+Scalar bigram_average_nll(Scalar **bigram, char **words, int num_words);
+void bigram_free(Scalar **bigram);
+
+// Words are assigned to splits in an 80/10/10 ratio by line number and seed.
+// split_next_word returns the split of the next line of a names file, given an
+// Rng seeded with the split seed and advanced once per preceding line.
+enum Split { TRAIN, DEV, TEST };
+
+enum Split split_next_word(Rng *rng);
+
+// A mini-batch of examples. Example i has block_size context tokens starting at
+// contexts[i * block_size] and the token that follows them in targets[i].
+typedef struct Batch {
+  int size;
+  int block_size;
+  int *contexts;
+  int *targets;
+  // Number of complete passes over the corpus when the batch was filled
+  long epoch;
+} Batch;
+
+// Streams batches from the words of one split of a names file, see loader.c.
+// split and split_seed select words as in dataset_load, and seed drives the
+// shuffle. block_size must be at least 1 and memory use is bounded by
+// buffer_size examples.
+typedef struct Loader Loader;
+
+Loader *loader_init(const char *path, enum Split split, uint64_t split_seed,
+                    int block_size, int batch_size, int buffer_size,
+                    uint64_t seed);
+Batch *loader_next(Loader *loader);
+void loader_free(Loader *loader);
 
 enum ValueType { CONSTANT, ADD, MULTIPLY, TANH, POW };
 
 typedef struct Value {
   enum ValueType type;
-  double data;
-  double grad;
+  Scalar data;
+  Scalar grad;
   char *label;
   struct Value *left_child;
   struct Value *right_child;
 } Value;
 
-Value *value_init_constant(double data);
-Value *value_init_constant_with_label(double data, char *label);
+Value *value_init_constant(Scalar data);
+Value *value_init_constant_with_label(Scalar data, char *label);
 Value *value_add(Value *value1, Value *value2);
 Value *value_minus(Value *value1, Value *value2);
 Value *value_times(Value *value1, Value *value2);
@@ -40,7 +135,7 @@ typedef struct Neuron {
   Value *b;
 } Neuron;
 
-Neuron *neuron_init(int num_inputs);
+Neuron *neuron_init(int num_inputs, Rng *rng);
 void neuron_free(Neuron *neuron);
 void neuron_print(Neuron *neuron);
 Value *neuron_apply(Neuron *neuron, Value **inputs);
@@ -51,7 +146,7 @@ typedef struct Layer {
   Neuron **neurons;
 } Layer;
 
-Layer *layer_init(int num_inputs, int num_outputs);
+Layer *layer_init(int num_inputs, int num_outputs, Rng *rng);
 void layer_free(Layer *layer);
 Value **layer_apply(Layer *layer, Value **inputs);
 
@@ -60,6 +155,140 @@ typedef struct MLP {
   Layer **layers;
 } MLP;
 
-MLP *mlp_init(int num_inputs, int *layer_outputs, int num_layer_outputs);
+MLP *mlp_init(int num_inputs, int *layer_outputs, int num_layer_outputs,
+              Rng *rng);
 Value **mlp_apply(MLP *mlp, Value **inputs);
 void mlp_free(MLP *mlp);
+
+// Contiguous snapshot of an MLP's weights for graph-free inference. Row j of
+// layer i holds the weights of neuron j, followed by biases[i][j].
+typedef struct MLPWeights {
+  int num_layers;
+  int *num_inputs;
+  int *num_outputs;
+  int max_width;
+  Scalar **weights;
+  Scalar **biases;
+  // The first layer's weights transposed, so that the weights an input feeds
+  // into are contiguous. Used for one-hot inputs.
+  Scalar *first_layer_columns;
+  // Use kernels.tanh_fast instead of kernels.tanh for the activations. Off by
+  // default; trades up to 1e-4 per activation for throughput.
+  int fast_tanh;
+} MLPWeights;
+
+MLPWeights *mlp_weights_init(MLP *mlp);
+void mlp_weights_forward(MLPWeights *weights, const Scalar *inputs,
+                         Scalar *outputs);
+// Forward pass over a batch of contexts of block_size tokens each, which are
+// one-hot encoded into the first layer's block_size * ALPHABET_SIZE inputs.
+// Writes one row of outputs per context.
+void mlp_weights_forward_contexts(MLPWeights *weights, const int *contexts,
+                                  int num_contexts, int block_size,
+                                  Scalar *outputs);
+void mlp_weights_free(MLPWeights *weights);
+
+// Any model that predicts the next token from the previous block_size tokens.
+// log_probs writes ALPHABET_SIZE log-probabilities for each of num_contexts
+// contexts and must be safe to call from several threads at once.
+typedef struct LanguageModel {
+  int block_size;
+  void *state;
+  void (*log_probs)(void *state, const int *contexts, int num_contexts,
+                    Scalar *out);
+  void (*free_state)(void *state);
+} LanguageModel;
+
+LanguageModel *bigram_model_init(Scalar **bigram);
+// Inputs are the one-hot encoded context, so the MLP must take
+// block_size * ALPHABET_SIZE inputs and produce ALPHABET_SIZE logits
+LanguageModel *mlp_model_init(MLPWeights *weights, int block_size);
+void language_model_free(LanguageModel *model);
+
+// MLP weights quantized to int8 with one scale per output, so that
+// weights[i][j * padded_inputs[i] + k] * scales[i][j] approximates the weight
+// from input k to output j. Rows are zero-padded to a multiple of
+// QUANTIZED_ROW_ALIGNMENT bytes. The first layer only sees one-hot inputs and
+// is stored transposed instead, at weights[0][k * num_outputs[0] + j] with
+// padded_inputs[0] == num_inputs[0]. Later layers take tanh outputs,
+// quantized on the fly with a fixed scale of 1/127, and use integer dot
+// products.
+typedef struct QuantizedMLP {
+  int num_layers;
+  int *num_inputs;
+  int *num_outputs;
+  int *padded_inputs;
+  int max_width;
+  int max_padded_inputs;
+  int8_t **weights;
+  Scalar **scales;
+  Scalar **biases;
+  // Copied from the MLPWeights, see there
+  int fast_tanh;
+} QuantizedMLP;
+
+// Widest vector of any kernel variant, in bytes
+#define QUANTIZED_ROW_ALIGNMENT 64
+
+QuantizedMLP *quantized_mlp_init(MLPWeights *weights);
+// Same interface as mlp_weights_forward_contexts
+void quantized_mlp_forward_contexts(QuantizedMLP *mlp, const int *contexts,
+                                    int num_contexts, int block_size,
+                                    Scalar *outputs);
+void quantized_mlp_free(QuantizedMLP *mlp);
+
+// Bigram log-probabilities in int16 fixed point with 11 fractional bits,
+// covering [-16, 0)
+#define QUANTIZED_LOG_PROB_SCALE 2048
+
+int16_t *quantized_bigram_init(Scalar **bigram);
+
+LanguageModel *quantized_bigram_model_init(int16_t *log_probs);
+LanguageModel *quantized_mlp_model_init(QuantizedMLP *mlp, int block_size);
+
+typedef struct GenerateConfig {
+  // Divides the log-probs before sampling. 0 picks the most likely token.
+  Scalar temperature;
+  // Sample only from the top_k most likely tokens, or all if 0
+  int top_k;
+  // Sample only from the most likely tokens whose probability adds up to
+  // top_p, or all if 1
+  Scalar top_p;
+  // Use beam search with this many beams instead of sampling if > 0
+  int beam_width;
+  // Number of sequences sampled per log_probs call
+  int batch_size;
+  // Longer words are discarded
+  int max_chars;
+} GenerateConfig;
+
+typedef void (*GenerateCallback)(const char *word, void *data);
+
+// Generates up to num_words unique words, passing each to callback as soon as
+// it's finished. Returns the number of words generated.
+int generate(LanguageModel *model, GenerateConfig *config, Rng *rng,
+             int num_words, GenerateCallback callback, void *data);
+
+typedef struct Dataset {
+  int num_words;
+  char **words;
+} Dataset;
+
+Dataset *dataset_load(const char *path, enum Split split, uint64_t seed);
+void dataset_free(Dataset *dataset);
+
+typedef struct Evaluation {
+  double nll;
+  long num_tokens;
+  double seconds;
+  double tokens_per_second;
+} Evaluation;
+
+Evaluation evaluate(LanguageModel *model, Dataset *dataset, int num_threads);
+
+// Prints NLL, memory and throughput of a model next to its quantized version
+// and returns the change in NLL
+double quantization_report(const char *name, LanguageModel *model,
+                           LanguageModel *quantized, size_t num_bytes,
+                           size_t num_quantized_bytes, Dataset *dataset,
+                           int num_threads);
@@ -0,0 +1,231 @@
+#include "makemore.h"
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// out[i] = round(values[i] / scale), where |values[i]| <= 127 * scale. Uses the
+// reciprocal and rounds half away from zero, which unlike a divide and lrint
+// vectorizes.
+static void quantize_i8_with_scale(int8_t *out, const Scalar *values, int n,
+                                   Scalar scale) {
+  Scalar inverse = 1 / scale;
+  for (int i = 0; i < n; i++) {
+    Scalar value = values[i] * inverse;
+    out[i] = (int8_t)(value + (value < 0 ? (Scalar)-0.5 : (Scalar)0.5));
+  }
+}
+
+// Symmetric int8 quantization of n values with a single scale. Returns the
+// scale, or 1 if all values are zero.
+static Scalar quantize_i8(int8_t *out, const Scalar *values, int n) {
+  Scalar max = 0;
+  for (int i = 0; i < n; i++) {
+    Scalar magnitude = values[i] < 0 ? -values[i] : values[i];
+    if (magnitude > max) {
+      max = magnitude;
+    }
+  }
+  if (max == 0) {
+    for (int i = 0; i < n; i++) {
+      out[i] = 0;
+    }
+    return 1;
+  }
+
+  quantize_i8_with_scale(out, values, n, max / 127);
+  return max / 127;
+}
+
+QuantizedMLP *quantized_mlp_init(MLPWeights *weights) {
+  QuantizedMLP *mlp = (QuantizedMLP *)allocate(sizeof(QuantizedMLP));
+  int num_layers = weights->num_layers;
+  mlp->num_layers = num_layers;
+  mlp->num_inputs = (int *)allocate(num_layers * sizeof(int));
+  mlp->num_outputs = (int *)allocate(num_layers * sizeof(int));
+  mlp->padded_inputs = (int *)allocate(num_layers * sizeof(int));
+  mlp->max_width = weights->max_width;
+  mlp->max_padded_inputs = 0;
+  mlp->fast_tanh = weights->fast_tanh;
+  mlp->weights = (int8_t **)allocate(num_layers * sizeof(int8_t *));
+  mlp->scales = (Scalar **)allocate(num_layers * sizeof(Scalar *));
+  mlp->biases = (Scalar **)allocate(num_layers * sizeof(Scalar *));
+
+  for (int i = 0; i < num_layers; i++) {
+    int num_inputs = weights->num_inputs[i];
+    int num_outputs = weights->num_outputs[i];
+    int padded_inputs =
+        i == 0 ? num_inputs
+               : (num_inputs + QUANTIZED_ROW_ALIGNMENT - 1) /
+                     QUANTIZED_ROW_ALIGNMENT * QUANTIZED_ROW_ALIGNMENT;
+    mlp->num_inputs[i] = num_inputs;
+    mlp->num_outputs[i] = num_outputs;
+    mlp->padded_inputs[i] = padded_inputs;
+    if (padded_inputs > mlp->max_padded_inputs) {
+      mlp->max_padded_inputs = padded_inputs;
+    }
+    mlp->weights[i] = (int8_t *)allocate(num_outputs * padded_inputs);
+    mlp->scales[i] = (Scalar *)allocate(num_outputs * sizeof(Scalar));
+    mlp->biases[i] = (Scalar *)allocate(num_outputs * sizeof(Scalar));
+
+    for (int j = 0; j < num_outputs; j++) {
+      int8_t *row = mlp->weights[i] + j * padded_inputs;
+      mlp->scales[i][j] = quantize_i8(
+          row, weights->weights[i] + j * num_inputs, num_inputs);
+      memset(row + num_inputs, 0, padded_inputs - num_inputs);
+      mlp->biases[i][j] = weights->biases[i][j];
+    }
+  }
+
+  // Transpose the first layer, see QuantizedMLP
+  int num_inputs = mlp->num_inputs[0];
+  int num_outputs = mlp->num_outputs[0];
+  int8_t *columns = (int8_t *)allocate(num_inputs * num_outputs);
+  for (int j = 0; j < num_outputs; j++) {
+    for (int k = 0; k < num_inputs; k++) {
+      columns[k * num_outputs + j] = mlp->weights[0][j * num_inputs + k];
+    }
+  }
+  free(mlp->weights[0]);
+  mlp->weights[0] = columns;
+  return mlp;
+}
+
+// Contexts per tile in quantized_mlp_forward_contexts, see MLP_FORWARD_TILE
+#define QUANTIZED_FORWARD_TILE 32
+
+// Scale of the quantized tanh activations that feed every layer after the first
+#define QUANTIZED_ACTIVATION_SCALE ((Scalar)1 / 127)
+
+static void quantized_mlp_forward_tile(QuantizedMLP *mlp, const int *contexts,
+                                       int num_contexts, int block_size,
+                                       Scalar *outputs, Scalar **buffers,
+                                       int8_t *quantized) {
+  int num_layers = mlp->num_layers;
+  for (int i = 0; i < num_layers; i++) {
+    int num_inputs = mlp->num_inputs[i];
+    int num_outputs = mlp->num_outputs[i];
+    int padded_inputs = mlp->padded_inputs[i];
+    const int8_t *w = mlp->weights[i];
+    const Scalar *scales = mlp->scales[i];
+    const Scalar *b = mlp->biases[i];
+    const Scalar *layer_inputs = buffers[(i + 1) % 2];
+    Scalar *layer_outputs = i == num_layers - 1 ? outputs : buffers[i % 2];
+
+    if (i == 0) {
+      // One-hot inputs need no quantization: the integer dot product is the
+      // sum of the weights of the active inputs, which is exact in Scalar
+      for (int c = 0; c < num_contexts; c++) {
+        Scalar *out = layer_outputs + c * num_outputs;
+        memset(out, 0, num_outputs * sizeof(Scalar));
+        for (int k = 0; k < block_size; k++) {
+          const int8_t *column =
+              w + (k * ALPHABET_SIZE + contexts[c * block_size + k]) *
+                      num_outputs;
+          for (int j = 0; j < num_outputs; j++) {
+            out[j] += column[j];
+          }
+        }
+        for (int j = 0; j < num_outputs; j++) {
+          out[j] = out[j] * scales[j] + b[j];
+        }
+      }
+    } else {
+      // The inputs are tanh outputs in [-1, 1], so they share a fixed scale.
+      // Rows are zero-padded so that dot_i8 never reaches its scalar tail.
+      for (int c = 0; c < num_contexts; c++) {
+        int8_t *row = quantized + c * padded_inputs;
+        quantize_i8_with_scale(row, layer_inputs + c * num_inputs, num_inputs,
+                               QUANTIZED_ACTIVATION_SCALE);
+        memset(row + num_inputs, 0, padded_inputs - num_inputs);
+      }
+
+      for (int j = 0; j < num_outputs; j++) {
+        const int8_t *row = w + j * padded_inputs;
+        Scalar row_scale = scales[j] * QUANTIZED_ACTIVATION_SCALE;
+        for (int c = 0; c < num_contexts; c++) {
+          int32_t dot =
+              kernels.dot_i8(row, quantized + c * padded_inputs, padded_inputs);
+          layer_outputs[c * num_outputs + j] = dot * row_scale + b[j];
+        }
+      }
+    }
+
+    if (mlp->fast_tanh) {
+      kernels.tanh_fast(layer_outputs, layer_outputs,
+                        num_contexts * num_outputs);
+    } else {
+      kernels.tanh(layer_outputs, layer_outputs, num_contexts * num_outputs);
+    }
+  }
+}
+
+void quantized_mlp_forward_contexts(QuantizedMLP *mlp, const int *contexts,
+                                    int num_contexts, int block_size,
+                                    Scalar *outputs) {
+  Scalar *buffers[2];
+  for (int i = 0; i < 2; i++) {
+    buffers[i] = (Scalar *)allocate(QUANTIZED_FORWARD_TILE * mlp->max_width *
+                                    sizeof(Scalar));
+  }
+  int8_t *quantized =
+      (int8_t *)allocate(QUANTIZED_FORWARD_TILE * mlp->max_padded_inputs);
+
+  int num_logits = mlp->num_outputs[mlp->num_layers - 1];
+  for (int c = 0; c < num_contexts; c += QUANTIZED_FORWARD_TILE) {
+    int count = num_contexts - c < QUANTIZED_FORWARD_TILE
+                    ? num_contexts - c
+                    : QUANTIZED_FORWARD_TILE;
+    quantized_mlp_forward_tile(mlp, contexts + c * block_size, count,
+                               block_size, outputs + c * num_logits, buffers,
+                               quantized);
+  }
+
+  free(quantized);
+  free(buffers[0]);
+  free(buffers[1]);
+}
+
+void quantized_mlp_free(QuantizedMLP *mlp) {
+  for (int i = 0; i < mlp->num_layers; i++) {
+    free(mlp->weights[i]);
+    free(mlp->scales[i]);
+    free(mlp->biases[i]);
+  }
+  free(mlp->weights);
+  free(mlp->scales);
+  free(mlp->biases);
+  free(mlp->num_inputs);
+  free(mlp->num_outputs);
+  free(mlp->padded_inputs);
+  free(mlp);
+}
+
+int16_t *quantized_bigram_init(Scalar **bigram) {
+  int16_t *log_probs =
+      (int16_t *)allocate(ALPHABET_SIZE * ALPHABET_SIZE * sizeof(int16_t));
+  for (int i = 0; i < ALPHABET_SIZE; i++) {
+    for (int j = 0; j < ALPHABET_SIZE; j++) {
+      long value = lrint(SCALAR_LOG(bigram[i][j]) * QUANTIZED_LOG_PROB_SCALE);
+      log_probs[i * ALPHABET_SIZE + j] =
+          value < INT16_MIN ? INT16_MIN : (int16_t)value;
+    }
+  }
+  return log_probs;
+}
+
+double quantization_report(const char *name, LanguageModel *model,
+                           LanguageModel *quantized, size_t num_bytes,
+                           size_t num_quantized_bytes, Dataset *dataset,
+                           int num_threads) {
+  Evaluation evaluation = evaluate(model, dataset, num_threads);
+  Evaluation quantized_evaluation = evaluate(quantized, dataset, num_threads);
+
+  printf("%s: nll %f -> %f (%+f), %zu -> %zu bytes, %.0f -> %.0f tokens/s\n",
+         name, evaluation.nll, quantized_evaluation.nll,
+         quantized_evaluation.nll - evaluation.nll, num_bytes,
+         num_quantized_bytes, evaluation.tokens_per_second,
+         quantized_evaluation.tokens_per_second);
+  return quantized_evaluation.nll - evaluation.nll;
+}